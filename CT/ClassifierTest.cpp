@@ -0,0 +1,64 @@
+/************************************************************************
+* File:	ClassifierTest.cpp
+* Brief: Checks that the log domain classifier chooses the same sample as
+*        the ratio classifier of the paper, on random gaussian models
+************************************************************************/
+#include "CompressiveTracker.h"
+#include <iostream>
+
+using std::cout;
+using std::endl;
+
+class ClassifierTest
+{
+public:
+	// Returns the number of trials in which radioClassifierLog and radioClassifier choose different samples
+	static int run(int _trials)
+	{
+		RNG rng(11);
+		int mismatches = 0;
+
+		for (int t=0; t<_trials; t++)
+		{
+			CompressiveTracker ct;
+			int sampleNum = 1000 + t;
+			Mat sampleFeatureValue(ct.featureNum, sampleNum, CV_32F);
+
+			// feature values far from the mean make the densities reach 1e-30, where both classifiers regularize
+			for (int i=0; i<ct.featureNum; i++)
+			{
+				ct.muPositive[i] = rng.uniform(-2e4f, 2e4f);
+				ct.sigmaPositive[i] = rng.uniform(10.0f, 3000.0f);
+				ct.muNegative[i] = ct.muPositive[i] + rng.uniform(-3e3f, 3e3f);
+				ct.sigmaNegative[i] = rng.uniform(10.0f, 5000.0f);
+				for (int j=0; j<sampleNum; j++)
+					sampleFeatureValue.at<float>(i,j) = ct.muPositive[i] + rng.uniform(-4.0f, 4.0f)*ct.sigmaPositive[i]*(j%7 == 0 ? 3 : 1);
+			}
+			ct.classifierCoefficients(ct.muPositive, ct.sigmaPositive, ct.coeffPositive);
+			ct.classifierCoefficients(ct.muNegative, ct.sigmaNegative, ct.coeffNegative);
+
+			vector<float> sumRadio;
+			float radioMax, radioMaxExact;
+			int radioMaxIndex, radioMaxIndexExact;
+			ct.radioClassifierLog(sampleFeatureValue, sumRadio, radioMax, radioMaxIndex);
+			ct.radioClassifier(ct.muPositive, ct.sigmaPositive, ct.muNegative, ct.sigmaNegative, sampleFeatureValue, radioMaxExact, radioMaxIndexExact);
+
+			if (radioMaxIndex != radioMaxIndexExact)
+			{
+				cout << "trial " << t << ": log domain chose " << radioMaxIndex << " (" << radioMax << "), exact chose "
+					<< radioMaxIndexExact << " (" << radioMaxExact << ")" << endl;
+				mismatches++;
+			}
+		}
+
+		return mismatches;
+	}
+};
+
+int main(int argc, char * argv[])
+{
+	int trials = 300;
+	int mismatches = ClassifierTest::run(trials);
+	cout << "classifier mismatches: " << mismatches << "/" << trials << endl;
+	return mismatches == 0 ? 0 : 1;
+}
@@ -1,6 +1,12 @@
 #include "CompressiveTracker.h"
 #include <math.h>
 #include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __FMA__
+#include <immintrin.h>
+#endif
 using namespace cv;
 using namespace std;
 
@@ -17,6 +23,19 @@ CompressiveTracker::CompressiveTracker(void)
 	sigmaPositive = vector<float>(featureNum, 1.0f);
 	sigmaNegative = vector<float>(featureNum, 1.0f);
 	learnRate = 0.85f;	// Learning rate parameter
+	currentScale = 1.0f;
+	logDomainClassifier = true;
+	checkClassifier = false;
+	classifierMismatches = 0;
+	coarseToFine = false;
+	rSearchCoarse = 25;	// search radii and steps of the coarse-to-fine detection, as in the paper
+	stepCoarse = 4;
+	rSearchFine = 10;
+	stepFine = 1;
+	multiScale = false;
+	scaleFactors.push_back(0.95f);	// scales searched relative to the current one
+	scaleFactors.push_back(1.0f);
+	scaleFactors.push_back(1.05f);
 }
 
 CompressiveTracker::~CompressiveTracker(void)
@@ -33,6 +52,9 @@ void CompressiveTracker::HaarFeature(Rect& _objectBox, int _numFeature)
 {
 	features = vector<vector<Rect> >(_numFeature, vector<Rect>());
 	featuresWeight = vector<vector<float> >(_numFeature, vector<float>());
+	featureTable.step = 0;	// the flattened tables have to be rebuilt, also those of the scale searches
+	for (size_t i=0; i<searches.size(); i++)
+		searches[i].table.step = 0;
 	
 	int numRect;
 	Rect rectTemp;
@@ -59,6 +81,53 @@ void CompressiveTracker::HaarFeature(Rect& _objectBox, int _numFeature)
 }
 
 
+void CompressiveTracker::reserveSamples(vector<Rect>& _sampleBox, int _sampleNum, int& _allocations)
+/* Description: make room for _sampleNum boxes, so that they are collected without reallocations. */
+{
+	if ((int)_sampleBox.capacity() < _sampleNum)
+	{
+		_sampleBox.reserve(_sampleNum);
+		_allocations++;
+	}
+}
+
+void CompressiveTracker::reserveRadio(vector<float>& _sumRadio, int _sampleNum, int& _allocations)
+/* Description: make room for the classifier sums of _sampleNum boxes, so that radioClassifierLog does not reallocate them. */
+{
+	if ((int)_sumRadio.capacity() < _sampleNum)
+	{
+		_sumRadio.reserve(_sampleNum);
+		_allocations++;
+	}
+}
+
+void CompressiveTracker::poolFeatureValue(Mat& _pool, int _sampleNum, Mat& _sampleFeatureValue, int& _allocations)
+/* Description: point _sampleFeatureValue to the first _sampleNum columns of _pool, which is grown if it is too small.
+   getFeatureValue then writes into the pool instead of allocating a matrix per frame. The capacity is doubled,
+   so that the varying number of negative samples settles after one growth. */
+{
+	if (_pool.rows != featureNum || _pool.cols < _sampleNum)
+	{
+		_pool.create(featureNum, max(_sampleNum, 2*_pool.cols), CV_32F);
+		_allocations++;
+	}
+	_sampleFeatureValue = _pool.colRange(0, _sampleNum);
+}
+
+int CompressiveTracker::skipSamples(float _prob, double _logSkip, int _limit)
+/* Description: number of candidates rejected before the next accepted one, when each is accepted with probability _prob.
+   Drawing the geometrically distributed gap needs one random number per accepted sample instead of one per candidate.
+   _logSkip is log(1 - _prob).
+*/
+{
+	if (_prob >= 1.0f)
+		return 0;
+	if (_prob <= 0.0f)
+		return _limit;
+	double skip = floor(log(1.0 - rng.uniform(0., 1.)) / _logSkip);
+	return skip < _limit ? (int)skip : _limit;
+}
+
 void CompressiveTracker::sampleRect(Mat& _image, Rect& _objectBox, float _rInner, float _rOuter, int _maxSampleNum, vector<Rect>& _sampleBox)
 /* Description: compute the coordinate of positive and negative sample image templates
    Arguments:
@@ -85,34 +154,35 @@ void CompressiveTracker::sampleRect(Mat& _image, Rect& _objectBox, float _rInner
     
 	
 	
-	int i = 0;
+	int cols = maxcol-mincol+1;
+	int total = (maxrow-minrow+1)*cols;
 
 	float prob = ((float)(_maxSampleNum))/(maxrow-minrow+1)/(maxcol-mincol+1);
+	double logSkip = prob < 1.0f ? log(1.0 - prob) : 0.0;
 
 	int r;
 	int c;
     
     _sampleBox.clear();//important
-    Rect rec(0,0,0,0);
+    Rect rec(0,0,_objectBox.width,_objectBox.height);
 
-	for( r=minrow; r<=(int)maxrow; r++ )
-		for( c=mincol; c<=(int)maxcol; c++ ){
-			dist = (_objectBox.y-r)*(_objectBox.y-r) + (_objectBox.x-c)*(_objectBox.x-c);
+	if (maxrow < minrow || maxcol < mincol)
+		return;
 
-			if( rng.uniform(0.,1.)<prob && dist < inradsq && dist >= outradsq ){
+	// every position is kept with probability prob, as if a uniform number was drawn for each of them
+	for( int k=skipSamples(prob, logSkip, total); k<total; k+=1+skipSamples(prob, logSkip, total) ){
+		r = minrow + k/cols;
+		c = mincol + k%cols;
+		dist = (_objectBox.y-r)*(_objectBox.y-r) + (_objectBox.x-c)*(_objectBox.x-c);
 
-                rec.x = c;
-				rec.y = r;
-				rec.width = _objectBox.width;
-				rec.height= _objectBox.height;
-				
-                _sampleBox.push_back(rec);				
-				
-				i++;
-			}
+		if( dist < inradsq && dist >= outradsq ){
+
+			rec.x = c;
+			rec.y = r;
+
+			_sampleBox.push_back(rec);
 		}
-	
-		_sampleBox.resize(i);
+	}
 		
 }
 
@@ -159,53 +229,180 @@ void CompressiveTracker::sampleRect(Mat& _image, Rect& _objectBox, float _srw, v
 		_sampleBox.resize(i);
 
 }
-// Compute the features of samples
-void CompressiveTracker::getFeatureValue(Mat& _imageIntegral, vector<Rect>& _sampleBox, Mat& _sampleFeatureValue)
+void CompressiveTracker::buildFeatureTable(float _scale, int _step, FeatureTable& _table, int& _allocations)
+/* Description: flatten features and featuresWeight into arrays of corner offsets and weights
+   Arguments:
+   -_scale: size of the object relative to the initial box, the rects are scaled accordingly
+   -_step:  number of elements per row of the integral image
+   -_table: flattened features, rebuilt in place, its arrays only grow for new features
+*/
 {
-	int sampleBoxSize = _sampleBox.size();
-	_sampleFeatureValue.create(featureNum, sampleBoxSize, CV_32F);
-	float tempValue;
-	int xMin;
-	int xMax;
-	int yMin;
-	int yMax;
+	size_t numRect = 0;
+	for (int i=0; i<featureNum; i++)
+		numRect += features[i].size();
+	if (_table.weight.capacity() < numRect || _table.rectBegin.capacity() < (size_t)featureNum+1)
+	{
+		_table.rectBegin.reserve(featureNum+1);
+		_table.offsetTL.reserve(numRect);
+		_table.offsetTR.reserve(numRect);
+		_table.offsetBL.reserve(numRect);
+		_table.offsetBR.reserve(numRect);
+		_table.weight.reserve(numRect);
+		_allocations++;
+	}
+
+	_table.step = _step;
+	_table.scale = _scale;
+	_table.rectBegin.resize(featureNum+1);
+	_table.offsetTL.clear();
+	_table.offsetTR.clear();
+	_table.offsetBL.clear();
+	_table.offsetBR.clear();
+	_table.weight.clear();
 
 	for (int i=0; i<featureNum; i++)
 	{
-		for (int j=0; j<sampleBoxSize; j++)
+		_table.rectBegin[i] = _table.weight.size();
+		for (size_t k=0; k<features[i].size(); k++)
 		{
-			tempValue = 0.0f;
-			for (size_t k=0; k<features[i].size(); k++)
+			Rect rect = features[i][k];
+			float weight = featuresWeight[i][k];
+			if (_scale != 1.0f)
 			{
-				xMin = _sampleBox[j].x + features[i][k].x;
-				xMax = _sampleBox[j].x + features[i][k].x + features[i][k].width;
-				yMin = _sampleBox[j].y + features[i][k].y;
-				yMax = _sampleBox[j].y + features[i][k].y + features[i][k].height;
-				tempValue += featuresWeight[i][k] * 
-					(_imageIntegral.at<float>(yMin, xMin) +
-					_imageIntegral.at<float>(yMax, xMax) -
-					_imageIntegral.at<float>(yMin, xMax) -
-					_imageIntegral.at<float>(yMax, xMin));
+				// the weight compensates for the change of area, so that feature values are comparable across scales
+				Rect scaled(cvRound(rect.x*_scale), cvRound(rect.y*_scale), cvRound(rect.width*_scale), cvRound(rect.height*_scale));
+				if (scaled.area() > 0)
+					weight *= (float)rect.area() / scaled.area();
+				rect = scaled;
 			}
-			_sampleFeatureValue.at<float>(i,j) = tempValue;
+			_table.offsetTL.push_back(rect.y*_step + rect.x);
+			_table.offsetTR.push_back(rect.y*_step + rect.x + rect.width);
+			_table.offsetBL.push_back((rect.y + rect.height)*_step + rect.x);
+			_table.offsetBR.push_back((rect.y + rect.height)*_step + rect.x + rect.width);
+			_table.weight.push_back(weight);
+		}
+	}
+	_table.rectBegin[featureNum] = _table.weight.size();
+}
+
+void CompressiveTracker::sampleRect(Mat& _image, Rect& _objectBox, float _srw, int _step, vector<Rect>& _sampleBox, int& _allocations)
+/* Description: Compute the coordinate of samples on a grid with spacing _step around the object when detecting it.
+   With _step 1, the samples are the same as those of the dense search.*/
+{
+	int rowsz = _image.rows - _objectBox.height - 1;
+	int colsz = _image.cols - _objectBox.width - 1;
+	float inradsq = _srw*_srw;
+	int range = ((int)_srw / _step) * _step;
+
+	Rect rec(0, 0, _objectBox.width, _objectBox.height);
+	_sampleBox.clear();
+	reserveSamples(_sampleBox, (2*range/_step + 1)*(2*range/_step + 1), _allocations);
+
+	for (int dy=-range; dy<=range; dy+=_step)
+	{
+		rec.y = _objectBox.y + dy;
+		if (rec.y < 0 || rec.y > rowsz-1)
+			continue;
+		for (int dx=-range; dx<=range; dx+=_step)
+		{
+			rec.x = _objectBox.x + dx;
+			if (rec.x < 0 || rec.x > colsz-1 || dy*dy + dx*dx >= inradsq)
+				continue;
+			_sampleBox.push_back(rec);
+		}
+	}
+}
+
+// Compute one feature for _num horizontally adjacent samples, the first one having its top left corner at _origin
+static void featureValueRun(const float* _origin, const int* _tl, const int* _tr, const int* _bl, const int* _br,
+							const float* _weight, int _numRect, int _num, float* _value)
+{
+	for (int j=0; j<_num; j++)
+		_value[j] = 0.0f;
+
+	for (int k=0; k<_numRect; k++)
+	{
+		const float* tl = _origin + _tl[k];
+		const float* tr = _origin + _tr[k];
+		const float* bl = _origin + _bl[k];
+		const float* br = _origin + _br[k];
+		int j = 0;
+#ifdef __SSE2__
+		__m128 w = _mm_set1_ps(_weight[k]);
+		for (; j+4<=_num; j+=4)
+		{
+			__m128 sum = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(_mm_loadu_ps(tl+j), _mm_loadu_ps(br+j)), _mm_loadu_ps(tr+j)), _mm_loadu_ps(bl+j));
+			_mm_storeu_ps(_value+j, _mm_add_ps(_mm_loadu_ps(_value+j), _mm_mul_ps(w, sum)));
 		}
+#endif
+		for (; j<_num; j++)
+			_value[j] += _weight[k] * (tl[j] + br[j] - tr[j] - bl[j]);
+	}
+}
+
+// Compute the features of samples
+// Samples in the same row at consecutive x are evaluated together, their corners are adjacent in the integral image.
+void CompressiveTracker::getFeatureValue(Mat& _imageIntegral, vector<Rect>& _sampleBox, Mat& _sampleFeatureValue, int& _allocations)
+{
+	getFeatureValue(_imageIntegral, _sampleBox, currentScale, featureTable, _sampleFeatureValue, _allocations);
+}
+
+// Compute the features of samples at the given scale, _table is rebuilt if it belongs to a different scale
+void CompressiveTracker::getFeatureValue(Mat& _imageIntegral, vector<Rect>& _sampleBox, float _scale, FeatureTable& _table,
+										 Mat& _sampleFeatureValue, int& _allocations)
+{
+	int sampleBoxSize = _sampleBox.size();
+	_sampleFeatureValue.create(featureNum, sampleBoxSize, CV_32F);
+
+	int step = (int)_imageIntegral.step1();
+	if (step != _table.step || _scale != _table.scale)
+		buildFeatureTable(_scale, step, _table, _allocations);
+
+	const float* integralData = _imageIntegral.ptr<float>(0);
+
+	int runBegin = 0;
+	while (runBegin < sampleBoxSize)
+	{
+		int runEnd = runBegin + 1;
+		while (runEnd < sampleBoxSize && _sampleBox[runEnd].y == _sampleBox[runBegin].y
+			&& _sampleBox[runEnd].x == _sampleBox[runEnd-1].x + 1)
+			runEnd++;
+
+		const float* origin = integralData + _sampleBox[runBegin].y*step + _sampleBox[runBegin].x;
+
+		for (int i=0; i<featureNum; i++)
+		{
+			int k = _table.rectBegin[i];
+			featureValueRun(origin, &_table.offsetTL[k], &_table.offsetTR[k], &_table.offsetBL[k], &_table.offsetBR[k],
+				&_table.weight[k], _table.rectBegin[i+1] - k, runEnd - runBegin, _sampleFeatureValue.ptr<float>(i) + runBegin);
+		}
+
+		runBegin = runEnd;
 	}
 }
 
 // Update the mean and variance of the gaussian classifier
+// The mean and standard deviation of each feature are summed up in double like meanStdDev does, without a row header per feature
 void CompressiveTracker::classifierUpdate(Mat& _sampleFeatureValue, vector<float>& _mu, vector<float>& _sigma, float _learnRate)
 {
-	Scalar muTemp;
-	Scalar sigmaTemp;
+	int sampleNum = _sampleFeatureValue.cols;
     
 	for (int i=0; i<featureNum; i++)
 	{
-		meanStdDev(_sampleFeatureValue.row(i), muTemp, sigmaTemp);
+		const float* value = _sampleFeatureValue.ptr<float>(i);
+		double sum = 0.0, sqsum = 0.0;
+		for (int j=0; j<sampleNum; j++)
+		{
+			sum += value[j];
+			sqsum += (double)value[j]*value[j];
+		}
+		double muTemp = sampleNum > 0 ? sum / sampleNum : 0.0;
+		double sigmaTemp = sampleNum > 0 ? sqrt(max(sqsum / sampleNum - muTemp*muTemp, 0.0)) : 0.0;
 	   
-		_sigma[i] = (float)sqrt( _learnRate*_sigma[i]*_sigma[i]	+ (1.0f-_learnRate)*sigmaTemp.val[0]*sigmaTemp.val[0] 
-		+ _learnRate*(1.0f-_learnRate)*(_mu[i]-muTemp.val[0])*(_mu[i]-muTemp.val[0]));	// equation 6 in paper
+		_sigma[i] = (float)sqrt( _learnRate*_sigma[i]*_sigma[i]	+ (1.0f-_learnRate)*sigmaTemp*sigmaTemp 
+		+ _learnRate*(1.0f-_learnRate)*(_mu[i]-muTemp)*(_mu[i]-muTemp));	// equation 6 in paper
 
-		_mu[i] = _mu[i]*_learnRate + (1.0f-_learnRate)*muTemp.val[0];	// equation 6 in paper
+		_mu[i] = _mu[i]*_learnRate + (1.0f-_learnRate)*muTemp;	// equation 6 in paper
 	}
 }
 
@@ -236,39 +433,308 @@ void CompressiveTracker::radioClassifier(vector<float>& _muPos, vector<float>& _
 		}
 	}
 }
+// Precompute the log domain coefficients of the gaussian classifier, with the same regularization as radioClassifier:
+// log(p) = -(x-mu)^2/(2*sigma^2+1e-30) - log(sigma+1e-30) = a*(x-mu)^2+c
+// The quadratic is not expanded, as feature values are large compared to sigma and that would cancel badly in float
+void CompressiveTracker::classifierCoefficients(vector<float>& _mu, vector<float>& _sigma, vector<float>& _coeff)
+{
+	_coeff.resize(3*featureNum);
+	for (int i=0; i<featureNum; i++)
+	{
+		double a = -1.0 / (2.0f*_sigma[i]*_sigma[i]+1e-30);
+		_coeff[3*i] = (float)a;
+		_coeff[3*i+1] = _mu[i];
+		_coeff[3*i+2] = (float)(-log(_sigma[i]+1e-30));
+	}
+}
+
+#ifdef __SSE2__
+static inline __m128 mulAdd(__m128 _a, __m128 _b, __m128 _c)
+{
+#ifdef __FMA__
+	return _mm_fmadd_ps(_a, _b, _c);
+#else
+	return _mm_add_ps(_mm_mul_ps(_a, _b), _c);
+#endif
+}
+#endif
+
+// log(exp(_logP) + 1e-30), the regularized logarithm radioClassifier takes
+// Further than CLAMP_BAND from log(1e-30) the smaller term is below float precision, so exp and log are only needed close to it
+static const float CLAMP_BAND = 17.0f;
+static inline float clampedLog(float _logP, float _logMin)
+{
+	float d = _logP - _logMin;
+	if (d > CLAMP_BAND)
+		return _logP;
+	if (d < -CLAMP_BAND)
+		return _logMin;
+	return _logMin + (float)log(1.0 + exp((double)d));
+}
+
+// Log ratio of feature value _x, _cp and _cn are the coefficients a, mu, c of both classes
+static inline float logRatio(float _x, const float* _cp, const float* _cn, float _logMin)
+{
+	float dp = _x - _cp[1];
+	float dn = _x - _cn[1];
+	return clampedLog(_cp[0]*dp*dp + _cp[2], _logMin) - clampedLog(_cn[0]*dn*dn + _cn[2], _logMin);
+}
+
+// Compute the ratio classifier in the log domain, exp and log are only evaluated for densities close to 1e-30
+// The density is regularized like in radioClassifier, which adds 1e-30 before taking the logarithm
+void CompressiveTracker::radioClassifierLog(Mat& _sampleFeatureValue, vector<float>& _sumRadio, float& _radioMax, int& _radioMaxIndex)
+{
+	const float logMin = (float)log(1e-30);
+	int sampleBoxNum = _sampleFeatureValue.cols;
+
+	_sumRadio.assign(sampleBoxNum, 0.0f);
+	float* sum = _sumRadio.empty() ? NULL : &_sumRadio[0];
+
+	for (int i=0; i<featureNum; i++)
+	{
+		const float* x = _sampleFeatureValue.ptr<float>(i);
+		const float* cp = &coeffPositive[3*i];
+		const float* cn = &coeffNegative[3*i];
+		int j = 0;
+#ifdef __SSE2__
+		__m128 ap = _mm_set1_ps(cp[0]), mup = _mm_set1_ps(cp[1]), ccp = _mm_set1_ps(cp[2]);
+		__m128 an = _mm_set1_ps(cn[0]), mun = _mm_set1_ps(cn[1]), ccn = _mm_set1_ps(cn[2]);
+		__m128 lmin = _mm_set1_ps(logMin);
+		__m128 bandLow = _mm_set1_ps(logMin - CLAMP_BAND), bandHigh = _mm_set1_ps(logMin + CLAMP_BAND);
+		for (; j+4<=sampleBoxNum; j+=4)
+		{
+			__m128 x4 = _mm_loadu_ps(x+j);
+			__m128 dp = _mm_sub_ps(x4, mup);
+			__m128 dn = _mm_sub_ps(x4, mun);
+			__m128 logPos = mulAdd(_mm_mul_ps(ap, dp), dp, ccp);
+			__m128 logNeg = mulAdd(_mm_mul_ps(an, dn), dn, ccn);
+			__m128 inBand = _mm_or_ps(_mm_and_ps(_mm_cmpge_ps(logPos, bandLow), _mm_cmple_ps(logPos, bandHigh)),
+				_mm_and_ps(_mm_cmpge_ps(logNeg, bandLow), _mm_cmple_ps(logNeg, bandHigh)));
+			if (_mm_movemask_ps(inBand))
+			{
+				// some density is close to 1e-30, these samples need exp and log
+				for (int k=j; k<j+4; k++)
+					sum[k] += logRatio(x[k], cp, cn, logMin);
+				continue;
+			}
+			logPos = _mm_max_ps(logPos, lmin);
+			logNeg = _mm_max_ps(logNeg, lmin);
+			_mm_storeu_ps(sum+j, _mm_add_ps(_mm_loadu_ps(sum+j), _mm_sub_ps(logPos, logNeg)));
+		}
+#endif
+		for (; j<sampleBoxNum; j++)
+			sum[j] += logRatio(x[j], cp, cn, logMin);	// equation 4
+	}
+
+	_radioMax = -FLT_MAX;
+	_radioMaxIndex = 0;
+	for (int j=0; j<sampleBoxNum; j++)
+	{
+		if (_radioMax < sum[j])
+		{
+			_radioMax = sum[j];
+			_radioMaxIndex = j;
+		}
+	}
+}
+
+// Choose the sample with the highest classifier response
+void CompressiveTracker::classify(Mat& _sampleFeatureValue, vector<float>& _sumRadio, int& _mismatches, float& _radioMax, int& _radioMaxIndex)
+{
+	if (!logDomainClassifier)
+	{
+		radioClassifier(muPositive, sigmaPositive, muNegative, sigmaNegative, _sampleFeatureValue, _radioMax, _radioMaxIndex);
+		return;
+	}
+
+	radioClassifierLog(_sampleFeatureValue, _sumRadio, _radioMax, _radioMaxIndex);
+
+	if (checkClassifier)
+	{
+		float radioMaxExact;
+		int radioMaxIndexExact;
+		radioClassifier(muPositive, sigmaPositive, muNegative, sigmaNegative, _sampleFeatureValue, radioMaxExact, radioMaxIndexExact);
+		if (radioMaxIndexExact != _radioMaxIndex)
+			_mismatches++;
+	}
+}
+
 void CompressiveTracker::init(Mat& _frame, Rect& _objectBox)
 {
+	integral(_frame, frameIntegral, CV_32F);
+	init(_frame, frameIntegral, _objectBox);
+}
+
+void CompressiveTracker::init(Mat& _frame, Mat& _imageIntegral, Rect& _objectBox)
+{
+	objectSizeInitial = _objectBox.size();
+	currentScale = 1.0f;
+
 	// compute feature template
 	HaarFeature(_objectBox, featureNum);
 
 	// compute sample templates
-	sampleRect(_frame, _objectBox, rOuterPositive, 0, 1000000, samplePositiveBox);
-	sampleRect(_frame, _objectBox, rSearchWindow*1.5, rOuterPositive+4.0, 100, sampleNegativeBox);
-
-	integral(_frame, imageIntegral, CV_32F);
+	imageIntegral = _imageIntegral;
+	stats.frameAllocations = 0;
+	sampleTraining(_frame, _objectBox);
+	stats.allocations += stats.frameAllocations;
 
-	getFeatureValue(imageIntegral, samplePositiveBox, samplePositiveFeatureValue);
-	getFeatureValue(imageIntegral, sampleNegativeBox, sampleNegativeFeatureValue);
 	classifierUpdate(samplePositiveFeatureValue, muPositive, sigmaPositive, learnRate);
 	classifierUpdate(sampleNegativeFeatureValue, muNegative, sigmaNegative, learnRate);
+	classifierCoefficients(muPositive, sigmaPositive, coeffPositive);
+	classifierCoefficients(muNegative, sigmaNegative, coeffNegative);
 }
-void CompressiveTracker::processFrame(Mat& _frame, Rect& _objectBox)
+// Runs the searches of the multi-scale detection as separate tasks
+class DetectScales : public ParallelLoopBody
+{
+public:
+	DetectScales(CompressiveTracker& _tracker, Mat& _frame) : tracker(_tracker), frame(_frame) {}
+
+	virtual void operator()(const Range& _range) const
+	{
+		for (int i=_range.start; i<_range.end; i++)
+			tracker.detectScale(frame, tracker.searches[i]);
+	}
+
+private:
+	CompressiveTracker& tracker;
+	Mat& frame;
+};
+
+// Move _search.objectBox to the best scoring candidate of its scale, imageIntegral has to be computed already
+void CompressiveTracker::detectScale(Mat& _frame, ScaleSearch& _search)
 {
-	// predict
-	sampleRect(_frame, _objectBox, rSearchWindow,detectBox);
-	integral(_frame, imageIntegral, CV_32F);
-	getFeatureValue(imageIntegral, detectBox, detectFeatureValue);
 	int radioMaxIndex;
-	float radioMax;
-	radioClassifier(muPositive, sigmaPositive, muNegative, sigmaNegative, detectFeatureValue, radioMax, radioMaxIndex);
-	_objectBox = detectBox[radioMaxIndex];
+	_search.candidates = 0;
+	_search.mismatches = 0;
+	_search.allocations = 0;
+	_search.radioMax = -FLT_MAX;
+
+	if (coarseToFine)
+	{
+		sampleRect(_frame, _search.objectBox, rSearchCoarse, stepCoarse, _search.detectBox, _search.allocations);
+		if (_search.detectBox.empty())
+			return;
+		poolFeatureValue(_search.detectFeaturePool, _search.detectBox.size(), _search.detectFeatureValue, _search.allocations);
+		getFeatureValue(imageIntegral, _search.detectBox, _search.scale, _search.table, _search.detectFeatureValue, _search.allocations);
+		reserveRadio(_search.sumRadio, _search.detectBox.size(), _search.allocations);
+		classify(_search.detectFeatureValue, _search.sumRadio, _search.mismatches, _search.radioMax, radioMaxIndex);
+		_search.candidates = _search.detectBox.size();
+
+		Rect coarseBox = _search.detectBox[radioMaxIndex];
+		sampleRect(_frame, coarseBox, rSearchFine, stepFine, _search.detectBox, _search.allocations);
+	}
+	else
+	{
+		reserveSamples(_search.detectBox, (2*rSearchWindow + 1)*(2*rSearchWindow + 1), _search.allocations);
+		sampleRect(_frame, _search.objectBox, rSearchWindow, _search.detectBox);
+	}
+
+	// the box does not fit into the image at this scale, the coarse candidates still count as evaluated
+	if (_search.detectBox.empty())
+	{
+		_search.radioMax = -FLT_MAX;
+		return;
+	}
+
+	_search.candidates += _search.detectBox.size();
+
+	poolFeatureValue(_search.detectFeaturePool, _search.detectBox.size(), _search.detectFeatureValue, _search.allocations);
+	getFeatureValue(imageIntegral, _search.detectBox, _search.scale, _search.table, _search.detectFeatureValue, _search.allocations);
+	reserveRadio(_search.sumRadio, _search.detectBox.size(), _search.allocations);
+	classify(_search.detectFeatureValue, _search.sumRadio, _search.mismatches, _search.radioMax, radioMaxIndex);
+	_search.objectBox = _search.detectBox[radioMaxIndex];
+}
+
+// Move _objectBox to the best scoring candidate, imageIntegral has to be computed already
+void CompressiveTracker::detect(Mat& _frame, Rect& _objectBox)
+{
+	int numScales = multiScale ? scaleFactors.size() : 1;
+	if ((int)searches.size() < numScales)
+		stats.frameAllocations++;
+	searches.resize(numScales);
+
+	for (int i=0; i<numScales; i++)
+	{
+		ScaleSearch& search = searches[i];
+		search.scale = multiScale ? currentScale * scaleFactors[i] : currentScale;
+		search.objectBox = _objectBox;
+		if (search.scale != currentScale)
+		{
+			// same center, size of the initial box at the scale
+			search.objectBox.width = cvRound(objectSizeInitial.width * search.scale);
+			search.objectBox.height = cvRound(objectSizeInitial.height * search.scale);
+			search.objectBox.x = cvRound(_objectBox.x + (_objectBox.width - search.objectBox.width) / 2.0);
+			search.objectBox.y = cvRound(_objectBox.y + (_objectBox.height - search.objectBox.height) / 2.0);
+		}
+	}
+
+	if (numScales > 1)
+		parallel_for_(Range(0, numScales), DetectScales(*this, _frame));
+	else
+		detectScale(_frame, searches[0]);
+
+	int best = -1;
+	stats.detectCandidates = 0;
+	for (int i=0; i<numScales; i++)
+	{
+		stats.detectCandidates += searches[i].candidates;
+		classifierMismatches += searches[i].mismatches;
+		stats.frameAllocations += searches[i].allocations;
+		if (searches[i].candidates > 0 && (best == -1 || searches[best].radioMax < searches[i].radioMax))
+			best = i;
+	}
+
+	// keep the box if it does not fit into the image at any scale
+	if (best != -1)
+	{
+		_objectBox = searches[best].objectBox;
+		currentScale = searches[best].scale;
+	}
+
+	stats.frames++;
+	stats.totalDetectCandidates += stats.detectCandidates;
+}
+
+// Sample the positive and negative boxes around _objectBox and compute their features, imageIntegral has to be computed already
+void CompressiveTracker::sampleTraining(Mat& _frame, Rect& _objectBox)
+{
+	int allocations = 0;
+	int positiveMax = (2*rOuterPositive + 1)*(2*rOuterPositive + 1);
+	int negativeMax = (2*(int)(rSearchWindow*1.5) + 1)*(2*(int)(rSearchWindow*1.5) + 1);
+	reserveSamples(samplePositiveBox, positiveMax, allocations);
+	reserveSamples(sampleNegativeBox, negativeMax, allocations);
 
-	// update
 	sampleRect(_frame, _objectBox, rOuterPositive, 0.0, 1000000, samplePositiveBox);
 	sampleRect(_frame, _objectBox, rSearchWindow*1.5, rOuterPositive+4.0, 100, sampleNegativeBox);
-	
-	getFeatureValue(imageIntegral, samplePositiveBox, samplePositiveFeatureValue);
-	getFeatureValue(imageIntegral, sampleNegativeBox, sampleNegativeFeatureValue);
+
+	poolFeatureValue(samplePositiveFeaturePool, samplePositiveBox.size(), samplePositiveFeatureValue, allocations);
+	poolFeatureValue(sampleNegativeFeaturePool, sampleNegativeBox.size(), sampleNegativeFeatureValue, allocations);
+	getFeatureValue(imageIntegral, samplePositiveBox, samplePositiveFeatureValue, allocations);
+	getFeatureValue(imageIntegral, sampleNegativeBox, sampleNegativeFeatureValue, allocations);
+
+	stats.frameAllocations += allocations;
+}
+
+void CompressiveTracker::processFrame(Mat& _frame, Rect& _objectBox)
+{
+	integral(_frame, frameIntegral, CV_32F);
+	processFrame(_frame, frameIntegral, _objectBox);
+}
+
+void CompressiveTracker::processFrame(Mat& _frame, Mat& _imageIntegral, Rect& _objectBox)
+{
+	// predict
+	stats.frameAllocations = 0;
+	imageIntegral = _imageIntegral;
+	detect(_frame, _objectBox);
+
+	// update
+	sampleTraining(_frame, _objectBox);
 	classifierUpdate(samplePositiveFeatureValue, muPositive, sigmaPositive, learnRate);
 	classifierUpdate(sampleNegativeFeatureValue, muNegative, sigmaNegative, learnRate);
+	classifierCoefficients(muPositive, sigmaPositive, coeffPositive);
+	classifierCoefficients(muNegative, sigmaNegative, coeffNegative);
+
+	stats.allocations += stats.frameAllocations;
 }
\ No newline at end of file
@@ -23,6 +23,46 @@
 using std::vector;
 using namespace cv;
 //---------------------------------------------------
+// statistics of a tracker, accumulated over all frames
+struct CompressiveTrackerStats
+{
+	CompressiveTrackerStats() : frames(0), detectCandidates(0), totalDetectCandidates(0), allocations(0), frameAllocations(0) {}
+	int frames;
+	int detectCandidates;	// candidate boxes scored in the last frame
+	long totalDetectCandidates;
+	long allocations;	// growths of the buffers used per frame: samples, feature values, classifier sums, feature tables
+						// and scale searches, zero per frame in the steady state. Generating the features in init is not counted
+	int frameAllocations;	// in the last frame
+};
+// flattened feature table at one scale, rects of feature i are rectBegin[i] .. rectBegin[i+1]-1
+// corner offsets are relative to the top left corner of a sample in the integral image
+struct FeatureTable
+{
+	FeatureTable() : step(0), scale(0) {}
+	int step;
+	float scale;
+	vector<int> rectBegin;
+	vector<int> offsetTL;
+	vector<int> offsetTR;
+	vector<int> offsetBL;
+	vector<int> offsetBR;
+	vector<float> weight;
+};
+// detection state at one scale, searches are independent of each other so that they can run in parallel
+struct ScaleSearch
+{
+	float scale;
+	Rect objectBox;	// box around which is searched, the best candidate afterwards
+	FeatureTable table;
+	vector<Rect> detectBox;
+	Mat detectFeaturePool;
+	Mat detectFeatureValue;
+	vector<float> sumRadio;
+	float radioMax;
+	int candidates;
+	int mismatches;
+	int allocations;
+};
 class CompressiveTracker
 {
 public:
@@ -35,11 +75,17 @@ private:
 	int featureNum;
 	vector<vector<Rect> > features;
 	vector<vector<float> > featuresWeight;
+	FeatureTable featureTable;	// features at currentScale
+	Size objectSizeInitial;	// features are defined relative to the initial box
+	float currentScale;
 	int rOuterPositive;
 	vector<Rect> samplePositiveBox;
 	vector<Rect> sampleNegativeBox;
 	int rSearchWindow;
-	Mat imageIntegral;
+	Mat imageIntegral;	// integral image of the current frame, may be shared with other trackers
+	Mat frameIntegral;	// buffer of imageIntegral if it is computed by this tracker
+	Mat samplePositiveFeaturePool;	// feature values are headers into these buffers, which only grow
+	Mat sampleNegativeFeaturePool;
 	Mat samplePositiveFeatureValue;
 	Mat sampleNegativeFeatureValue;
 	vector<float> muPositive;
@@ -47,19 +93,56 @@ private:
 	vector<float> muNegative;
 	vector<float> sigmaNegative;
 	float learnRate;
-	vector<Rect> detectBox;
-	Mat detectFeatureValue;
+	vector<ScaleSearch> searches;
 	RNG rng;
+	// log domain classifier: log(p(x|y=1)/p(x|y=0)) of feature i is the difference of the regularized quadratics
+	// a*(x-mu)^2+c of both classes, the coefficients are updated after classifierUpdate
+	vector<float> coeffPositive;	// a, mu, c of feature i at 3*i
+	vector<float> coeffNegative;
 
 private:
 	void HaarFeature(Rect& _objectBox, int _numFeature);
+	void buildFeatureTable(float _scale, int _step, FeatureTable& _table, int& _allocations);
+	void reserveSamples(vector<Rect>& _sampleBox, int _sampleNum, int& _allocations);
+	void reserveRadio(vector<float>& _sumRadio, int _sampleNum, int& _allocations);
+	void poolFeatureValue(Mat& _pool, int _sampleNum, Mat& _sampleFeatureValue, int& _allocations);
+	int skipSamples(float _prob, double _logSkip, int _limit);
 	void sampleRect(Mat& _image, Rect& _objectBox, float _rInner, float _rOuter, int _maxSampleNum, vector<Rect>& _sampleBox);
 	void sampleRect(Mat& _image, Rect& _objectBox, float _srw, vector<Rect>& _sampleBox);
-	void getFeatureValue(Mat& _imageIntegral, vector<Rect>& _sampleBox, Mat& _sampleFeatureValue);
+	void sampleRect(Mat& _image, Rect& _objectBox, float _srw, int _step, vector<Rect>& _sampleBox, int& _allocations);
+	void sampleTraining(Mat& _frame, Rect& _objectBox);
+	void detect(Mat& _frame, Rect& _objectBox);
+	void detectScale(Mat& _frame, ScaleSearch& _search);
+	void getFeatureValue(Mat& _imageIntegral, vector<Rect>& _sampleBox, Mat& _sampleFeatureValue, int& _allocations);
+	void getFeatureValue(Mat& _imageIntegral, vector<Rect>& _sampleBox, float _scale, FeatureTable& _table, Mat& _sampleFeatureValue,
+						 int& _allocations);
 	void classifierUpdate(Mat& _sampleFeatureValue, vector<float>& _mu, vector<float>& _sigma, float _learnRate);
 	void radioClassifier(vector<float>& _muPos, vector<float>& _sigmaPos, vector<float>& _muNeg, vector<float>& _sigmaNeg,
 						Mat& _sampleFeatureValue, float& _radioMax, int& _radioMaxIndex);
+	void classifierCoefficients(vector<float>& _mu, vector<float>& _sigma, vector<float>& _coeff);
+	void radioClassifierLog(Mat& _sampleFeatureValue, vector<float>& _sumRadio, float& _radioMax, int& _radioMaxIndex);
+	void classify(Mat& _sampleFeatureValue, vector<float>& _sumRadio, int& _mismatches, float& _radioMax, int& _radioMaxIndex);
+
+	friend class DetectScales;
+	friend class ClassifierTest;
 public:
+	bool logDomainClassifier;	// use radioClassifierLog instead of radioClassifier
+	bool checkClassifier;	// run both classifiers and count how often they choose different samples
+	int classifierMismatches;
+	// coarse-to-fine detection: search rSearchCoarse with stepCoarse, then rSearchFine with stepFine around the best box
+	bool coarseToFine;
+	int rSearchCoarse;
+	int stepCoarse;
+	int rSearchFine;
+	int stepFine;
+	// multi-scale detection: search at currentScale times each of scaleFactors, in parallel
+	bool multiScale;
+	vector<float> scaleFactors;
+	CompressiveTrackerStats stats;
+
 	void processFrame(Mat& _frame, Rect& _objectBox);
 	void init(Mat& _frame, Rect& _objectBox);
+	// same with the integral image of _frame computed by the caller, so that trackers of one frame can share it
+	void processFrame(Mat& _frame, Mat& _imageIntegral, Rect& _objectBox);
+	void init(Mat& _frame, Mat& _imageIntegral, Rect& _objectBox);
 };
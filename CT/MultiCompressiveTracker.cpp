@@ -0,0 +1,50 @@
+#include "MultiCompressiveTracker.h"
+using namespace cv;
+using namespace std;
+
+// Runs the trackers of a frame as separate tasks, all of them read the same integral image
+class ProcessTargets : public ParallelLoopBody
+{
+public:
+	ProcessTargets(vector<CompressiveTracker>& _targets, Mat& _frame, Mat& _imageIntegral, vector<Rect>& _objectBoxes)
+		: targets(_targets), frame(_frame), imageIntegral(_imageIntegral), objectBoxes(_objectBoxes) {}
+
+	virtual void operator()(const Range& _range) const
+	{
+		for (int i=_range.start; i<_range.end; i++)
+			targets[i].processFrame(frame, imageIntegral, objectBoxes[i]);
+	}
+
+private:
+	vector<CompressiveTracker>& targets;
+	Mat& frame;
+	Mat& imageIntegral;
+	vector<Rect>& objectBoxes;
+};
+
+//------------------------------------------------
+MultiCompressiveTracker::MultiCompressiveTracker(void)
+{
+}
+
+MultiCompressiveTracker::~MultiCompressiveTracker(void)
+{
+}
+
+void MultiCompressiveTracker::init(Mat& _frame, vector<Rect>& _objectBoxes)
+{
+	if (targets.size() != _objectBoxes.size())
+		targets.resize(_objectBoxes.size());
+
+	integral(_frame, imageIntegral, CV_32F);
+
+	for (size_t i=0; i<targets.size(); i++)
+		targets[i].init(_frame, imageIntegral, _objectBoxes[i]);
+}
+
+void MultiCompressiveTracker::processFrame(Mat& _frame, vector<Rect>& _objectBoxes)
+{
+	integral(_frame, imageIntegral, CV_32F);
+
+	parallel_for_(Range(0, (int)targets.size()), ProcessTargets(targets, _frame, imageIntegral, _objectBoxes));
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "CompressiveTracker.h"
+
+// Tracks several independent objects in the same sequence.
+// The integral image is computed once per frame and shared, the trackers run in parallel.
+class MultiCompressiveTracker
+{
+public:
+	MultiCompressiveTracker(void);
+	~MultiCompressiveTracker(void);
+
+private:
+	Mat imageIntegral;
+
+public:
+	// targets may be configured before init, otherwise one default tracker per box is created
+	vector<CompressiveTracker> targets;
+
+	void init(Mat& _frame, vector<Rect>& _objectBoxes);
+	void processFrame(Mat& _frame, vector<Rect>& _objectBoxes);
+};
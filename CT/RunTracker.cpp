@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "CompressiveTracker.h"
+#include "MultiCompressiveTracker.h"
 #include "vot.hpp"
 
 using namespace cv;
@@ -40,6 +41,19 @@ void readImageSequenceFiles(char* ImgFilePath,vector <string> &imgNames);
 	-imgNames:  vector that stores image name
 	History: Created by Kaihua Zhang on 15/8/2012
 */
+bool readRegions(const char* regionFileName, vector<Rect> &boxes);
+/*  Description: read one initial region "x,y,width,height" per line
+    Arguments:
+	-regionFileName: region file name, "region.txt" in challenge mode
+	-boxes:          initial tracking positions of all targets
+*/
+
+void printStats(CompressiveTracker& ct)
+{
+	if (ct.stats.frames > 0)
+		cout << "detection candidates per frame: " << (double)ct.stats.totalDetectCandidates / ct.stats.frames << endl;
+	cout << "buffer allocations: " << ct.stats.allocations << " (last frame: " << ct.stats.frameAllocations << ")" << endl;
+}
 
 int main(int argc, char * argv[])
 {
@@ -60,10 +74,80 @@ int main(int argc, char * argv[])
 	
 	//Check if --challenge was passed as an argument
 	bool challengeMode = false;
+	bool multiTarget = false;
 	for (int i = 1; i < argc; i++) {
 		if (strcmp("--challenge", argv[i]) == 0) {
 			challengeMode = true;
 		}
+		//Track every region of region.txt, writing output_<n>.txt for the region in line n
+		if (strcmp("--multi-target", argv[i]) == 0) {
+			multiTarget = true;
+		}
+		//Use the original classifier with exp and log
+		if (strcmp("--exact-classifier", argv[i]) == 0) {
+			ct.logDomainClassifier = false;
+		}
+		//Run both classifiers and report how often they disagree
+		if (strcmp("--check-classifier", argv[i]) == 0) {
+			ct.checkClassifier = true;
+		}
+		//Search at several scales around the current one
+		if (strcmp("--multi-scale", argv[i]) == 0) {
+			ct.multiScale = true;
+		}
+		//Coarse-to-fine detection, optionally with radii and steps --coarse-to-fine=rCoarse,stepCoarse,rFine,stepFine
+		if (strncmp("--coarse-to-fine", argv[i], 16) == 0) {
+			ct.coarseToFine = true;
+			if (argv[i][16] == '=' && sscanf(argv[i] + 17, "%d,%d,%d,%d", &ct.rSearchCoarse, &ct.stepCoarse,
+					&ct.rSearchFine, &ct.stepFine) != 4) {
+				cerr << "--coarse-to-fine expects rCoarse,stepCoarse,rFine,stepFine" << endl;
+				return 1;
+			}
+		}
+	}
+
+	if (challengeMode && multiTarget) {
+		//load regions, images and prepare for output, output.txt receives the first target as in single target mode
+		VOT vot("region.txt", "images.txt", "output.txt");
+		MultiCompressiveTracker mct;
+		vector<Rect> boxes;
+		if (!readRegions("region.txt", boxes))
+			return 1;
+		if (boxes.empty()) {
+			cerr << "No regions found in region.txt" << endl;
+			return 1;
+		}
+
+		vector<ofstream*> outputs(boxes.size());
+		for (size_t i = 0; i < boxes.size(); i++) {
+			ostringstream outputName;
+			outputName << "output_" << i+1 << ".txt";
+			outputs[i] = new ofstream(outputName.str().c_str());
+		}
+
+		//configure the targets like the single tracker
+		mct.targets.resize(boxes.size(), ct);
+
+		vot.getNextImage(frame);
+		cvtColor(frame, grayImg, CV_RGB2GRAY);
+		mct.init(grayImg, boxes);
+
+		do {
+			vot.outputBoundingBox(boxes[0]);
+			for (size_t i = 0; i < boxes.size(); i++)
+				*outputs[i] << boxes[i].x << ", " << boxes[i].y << ", " << boxes[i].width << ", " << boxes[i].height << endl;
+			if (vot.getNextImage(frame) != 1)
+				break;
+			cvtColor(frame, grayImg, CV_RGB2GRAY);
+			mct.processFrame(grayImg, boxes);// Process frame
+		} while (true);
+
+		for (size_t i = 0; i < boxes.size(); i++) {
+			delete outputs[i];
+			cout << "target " << i+1 << ": ";
+			printStats(mct.targets[i]);
+		}
+		return 0;
 	}
 
 	if (challengeMode) {
@@ -85,6 +169,9 @@ int main(int argc, char * argv[])
 			ct.processFrame(grayImg, box);// Process frame
 			vot.outputBoundingBox(box);
 		}
+		if (ct.checkClassifier)
+			cout << "classifier mismatches: " << ct.classifierMismatches << endl;
+		printStats(ct);
 		return 0;
 	}
 
@@ -129,9 +216,34 @@ int main(int argc, char * argv[])
 	}
 	fclose(resultStream);
 
+	if (ct.checkClassifier)
+		cout << "classifier mismatches: " << ct.classifierMismatches << endl;
+	printStats(ct);
+
 	return 0;
 }
 
+bool readRegions(const char* regionFileName, vector<Rect> &boxes)
+{
+	boxes.clear();
+
+	ifstream f(regionFileName);
+	string line;
+	for (int lineNum = 1; getline(f, line); lineNum++) {
+		//skip empty lines, anything but exactly x,y,width,height (e.g. a polygon) is an error
+		if (line.find_first_not_of(" \t\r") == string::npos)
+			continue;
+		float x, y, w, h;
+		int end = 0;
+		if (sscanf(line.c_str(), "%f , %f , %f , %f %n", &x, &y, &w, &h, &end) != 4 || line[end] != '\0') {
+			cerr << regionFileName << ":" << lineNum << ": expected x,y,width,height" << endl;
+			return false;
+		}
+		boxes.push_back(Rect(x, y, w, h));
+	}
+	return true;
+}
+
 void readConfig(char* configFileName, char* imgFilePath, Rect &box)	
 {
 	int x;
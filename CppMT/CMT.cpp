@@ -3,20 +3,114 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+using cv::parallel_for_;
+using cv::ParallelLoopBody;
+using cv::Range;
+using cv::resize;
+using std::min;
+
 namespace cmt {
 
-void CMT::initialize(const Mat im_gray, const Rect rect)
+//Optical flow tracking and keypoint detection/description do not depend on each other.
+//This body runs them as two separate tasks, so that parallel_for_ can execute them concurrently.
+class TrackAndDetect : public ParallelLoopBody
+{
+public:
+    TrackAndDetect(Tracker & tracker, const vector<Mat> & pyr_prev, vector<Mat> & pyr_gray,
+            const Mat & im_gray, const Rect & roi, const vector<Point2f> & points_active,
+            const Ptr<FeatureDetector> & detector, const Ptr<DescriptorExtractor> & descriptor,
+            vector<Point2f> & points_tracked, vector<unsigned char> & status,
+            vector<KeyPoint> & keypoints, Mat & descriptors) :
+        tracker(tracker), pyr_prev(pyr_prev), pyr_gray(pyr_gray), im_gray(im_gray), roi(roi), points_active(points_active),
+        detector(detector), descriptor(descriptor), points_tracked(points_tracked), status(status),
+        keypoints(keypoints), descriptors(descriptors) {};
+
+    virtual void operator()(const Range & range) const
+    {
+        for (int i = range.start; i < range.end; i++)
+        {
+            if (i == 0)
+            {
+                //Build the pyramid of the current image, then track keypoints
+                tracker.buildPyramid(im_gray, pyr_gray);
+                tracker.track(pyr_prev, pyr_gray, points_active, points_tracked, status);
+            }
+
+            else
+            {
+                //Detect keypoints in the region of interest, compute descriptors in the whole image,
+                //so that keypoints close to the border of the region can still be described
+                detector->detect(im_gray(roi), keypoints);
+
+                for (size_t j = 0; j < keypoints.size(); j++)
+                {
+                    keypoints[j].pt.x += roi.x;
+                    keypoints[j].pt.y += roi.y;
+                }
+
+                descriptor->compute(im_gray, keypoints, descriptors);
+            }
+        }
+    }
+
+private:
+    Tracker & tracker;
+    const vector<Mat> & pyr_prev;
+    vector<Mat> & pyr_gray;
+    const Mat & im_gray;
+    const Rect & roi;
+    const vector<Point2f> & points_active;
+    const Ptr<FeatureDetector> & detector;
+    const Ptr<DescriptorExtractor> & descriptor;
+    vector<Point2f> & points_tracked;
+    vector<unsigned char> & status;
+    vector<KeyPoint> & keypoints;
+    Mat & descriptors;
+};
+
+//Scales a rotated rect about the origin of the image
+static RotatedRect scaleRotatedRect(const RotatedRect & rect, const float factor)
+{
+    return RotatedRect(rect.center * factor, Size2f(rect.size.width * factor, rect.size.height * factor), rect.angle);
+}
+
+void CMT::chooseWorkingScale(const Rect rect)
+{
+    working_scale = 1;
+
+    if (auto_resolution && rect.area() > 0)
+    {
+        working_scale = min(1.0, working_size / sqrt((double) rect.area()));
+    }
+
+    FILE_LOG(logDEBUG) << "Working scale " << working_scale;
+}
+
+Mat CMT::toWorkingResolution(const Mat im_gray)
+{
+    if (working_scale == 1) return im_gray;
+
+    Mat & im_work = ims_work[im_work_current];
+    im_work_current = 1 - im_work_current;
+
+    resize(im_gray, im_work, Size(), working_scale, working_scale, cv::INTER_AREA);
+
+    return im_work;
+}
+
+void CMT::initialize(const Mat im_gray_input, const Rect rect_input)
 {
     FILE_LOG(logDEBUG) << "CMT::initialize() call";
 
-    //Remember initial size
-    size_initial = rect.size();
+    //Everything happens at the working resolution
+    chooseWorkingScale(rect_input);
+    Mat im_gray = toWorkingResolution(im_gray_input);
+    Rect rect(cvRound(rect_input.x * working_scale), cvRound(rect_input.y * working_scale),
+            cvRound(rect_input.width * working_scale), cvRound(rect_input.height * working_scale));
 
-    //Remember initial image
+    //Remember initial image and its pyramid
     im_prev = im_gray;
-
-    //Compute center of rect
-    Point2f center = Point2f(rect.x + rect.width/2.0, rect.y + rect.height/2.0);
+    tracker.buildPyramid(im_prev, pyr_prev);
 
     //Initialize detector and descriptor
     detector = FeatureDetector::create(str_detector);
@@ -26,57 +120,65 @@ void CMT::initialize(const Mat im_gray, const Rect rect)
     vector<KeyPoint> keypoints;
     detector->detect(im_gray, keypoints);
 
-    //Divide keypoints into foreground and background keypoints according to selection
-    vector<KeyPoint> keypoints_fg;
-    vector<KeyPoint> keypoints_bg;
+    Mat descriptors;
+    descriptor->compute(im_gray, keypoints, descriptors);
+
+    initialize(rect, keypoints, descriptors);
+
+    bb_rot = scaleRotatedRect(bb_rot, 1 / working_scale);
+
+    FILE_LOG(logDEBUG) << "CMT::initialize() return";
+}
+
+void CMT::initialize(const Rect rect, const vector<KeyPoint> & keypoints, const Mat descriptors)
+{
+    FILE_LOG(logDEBUG) << "CMT::initialize() call";
+
+    //Remember initial size
+    size_initial = rect.size();
+
+    //Start from the initial bounding box, which serves as region of interest for the next detection
+    bb_rot = RotatedRect(Point2f(rect.x + rect.width/2.0, rect.y + rect.height/2.0), size_initial, 0);
+    frames_since_full = 0;
+
+    //Compute center of rect
+    Point2f center = Point2f(rect.x + rect.width/2.0, rect.y + rect.height/2.0);
+
+    //Divide keypoints and their descriptors into foreground and background according to selection.
+    //compute() has already removed the keypoints it could not describe, so keypoints and rows correspond.
+    vector<Point2f> points_fg;
+    vector<Point2f> points_bg;
+    Mat descs_fg;
+    Mat descs_bg;
 
     for (size_t i = 0; i < keypoints.size(); i++)
     {
-        KeyPoint k = keypoints[i];
-        Point2f pt = k.pt;
+        Point2f pt = keypoints[i].pt;
 
         if (pt.x > rect.x && pt.y > rect.y && pt.x < rect.br().x && pt.y < rect.br().y)
         {
-            keypoints_fg.push_back(k);
+            points_fg.push_back(pt);
+            descs_fg.push_back(descriptors.row(i));
         }
 
         else
         {
-            keypoints_bg.push_back(k);
+            points_bg.push_back(pt);
+            descs_bg.push_back(descriptors.row(i));
         }
 
     }
 
+    FILE_LOG(logDEBUG) << points_fg.size() << " foreground points.";
+
     //Create foreground classes
     vector<int> classes_fg;
-    classes_fg.reserve(keypoints_fg.size());
-    for (size_t i = 0; i < keypoints_fg.size(); i++)
+    classes_fg.reserve(points_fg.size());
+    for (size_t i = 0; i < points_fg.size(); i++)
     {
         classes_fg.push_back(i);
     }
 
-    //Compute foreground/background features
-    Mat descs_fg;
-    Mat descs_bg;
-    descriptor->compute(im_gray, keypoints_fg, descs_fg);
-    descriptor->compute(im_gray, keypoints_bg, descs_bg);
-
-    //Only now is the right time to convert keypoints to points, as compute() might remove some keypoints
-    vector<Point2f> points_fg;
-    vector<Point2f> points_bg;
-
-    for (size_t i = 0; i < keypoints_fg.size(); i++)
-    {
-        points_fg.push_back(keypoints_fg[i].pt);
-    }
-
-    FILE_LOG(logDEBUG) << points_fg.size() << " foreground points.";
-
-    for (size_t i = 0; i < keypoints_bg.size(); i++)
-    {
-        points_bg.push_back(keypoints_bg[i].pt);
-    }
-
     //Create normalized points
     vector<Point2f> points_normalized;
     for (size_t i = 0; i < points_fg.size(); i++)
@@ -90,26 +192,225 @@ void CMT::initialize(const Mat im_gray, const Rect rect)
     //Initialize consensus
     consensus.initialize(points_normalized);
 
+    //Initialize fusion, classes are bounded by the number of foreground points
+    fusion.initialize(classes_fg.size());
+
     //Create initial set of active keypoints
-    for (size_t i = 0; i < keypoints_fg.size(); i++)
+    points_active = points_fg;
+    classes_active = classes_fg;
+
+    num_initial_fg = points_fg.size();
+    num_inliers = num_initial_fg;
+
+    FILE_LOG(logDEBUG) << "CMT::initialize() return";
+}
+
+bool CMT::saveSnapshot(const string & path) const
+{
+    FILE_LOG(logDEBUG) << "CMT::saveSnapshot() call";
+
+    SnapshotWriter writer;
+    writer.open(path);
+
+    writer.writeString(str_detector);
+    writer.writeString(str_descriptor);
+
+    vector<float> size;
+    size.push_back(size_initial.width);
+    size.push_back(size_initial.height);
+    writer.writeVector(size);
+
+    matcher.save(writer);
+    consensus.save(writer);
+
+    bool ok = writer.close();
+
+    if (!ok)
     {
-        points_active.push_back(keypoints_fg[i].pt);
-        classes_active = classes_fg;
+        FILE_LOG(logERROR) << "Could not write snapshot " << path;
     }
 
-    FILE_LOG(logDEBUG) << "CMT::initialize() return";
+    FILE_LOG(logDEBUG) << "CMT::saveSnapshot() return";
+
+    return ok;
+}
+
+bool CMT::initializeFromSnapshot(const Mat im_gray_input, const Rect rect_input, const string & path)
+{
+    FILE_LOG(logDEBUG) << "CMT::initializeFromSnapshot() call";
+
+    SnapshotReader reader;
+    reader.open(path);
+
+    reader.readString(str_detector);
+    reader.readString(str_descriptor);
+
+    vector<float> size;
+    reader.readVector(size);
+
+    matcher.load(reader);
+    consensus.load(reader);
+
+    if (!reader.good() || size.size() != 2)
+    {
+        FILE_LOG(logERROR) << "Could not read snapshot " << path;
+        FILE_LOG(logDEBUG) << "CMT::initializeFromSnapshot() return";
+        return false;
+    }
+
+    //Consensus is indexed by the classes of the matcher, so both have to describe the same foreground points
+    size_t num_fg = matcher.pointsNormalized().size();
+    bool consistent = consensus.pointsNormalized().size() == num_fg;
+
+    const vector<int> & classes = matcher.classesDatabase();
+    for (size_t i = 0; consistent && i < classes.size(); i++)
+    {
+        consistent = classes[i] < (int) num_fg;
+    }
+
+    if (!consistent)
+    {
+        FILE_LOG(logERROR) << "Snapshot " << path << " has inconsistent matcher and consensus records";
+        FILE_LOG(logDEBUG) << "CMT::initializeFromSnapshot() return";
+        return false;
+    }
+
+    //Initialize detector and descriptor, the names come from the file and may be unknown
+    detector = FeatureDetector::create(str_detector);
+    descriptor = DescriptorExtractor::create(str_descriptor);
+
+    if (detector.empty() || descriptor.empty())
+    {
+        FILE_LOG(logERROR) << "Snapshot " << path << " uses unknown detector " << str_detector
+            << " or descriptor " << str_descriptor;
+        FILE_LOG(logDEBUG) << "CMT::initializeFromSnapshot() return";
+        return false;
+    }
+
+    size_initial = Size2f(size[0], size[1]);
+
+    //The model is placed into rect anyway, so the working resolution can be chosen freely
+    chooseWorkingScale(rect_input);
+    Mat im_gray = toWorkingResolution(im_gray_input);
+    Rect rect(cvRound(rect_input.x * working_scale), cvRound(rect_input.y * working_scale),
+            cvRound(rect_input.width * working_scale), cvRound(rect_input.height * working_scale));
+
+    //Remember initial image and its pyramid
+    im_prev = im_gray;
+    tracker.buildPyramid(im_prev, pyr_prev);
+
+    //Place the foreground points of the model into rect
+    Point2f center = Point2f(rect.x + rect.width/2.0, rect.y + rect.height/2.0);
+    float scale = size_initial.width > 0 ? rect.width / size_initial.width : 1;
+
+    const vector<Point2f> & points_normalized = matcher.pointsNormalized();
+
+    points_active.clear();
+    classes_active.clear();
+    for (size_t i = 0; i < points_normalized.size(); i++)
+    {
+        points_active.push_back(center + scale * points_normalized[i]);
+        classes_active.push_back(i);
+    }
+
+    //Initialize fusion, classes are bounded by the number of foreground points
+    fusion.initialize(points_normalized.size());
+
+    bb_rot = RotatedRect(center * (1 / working_scale), size_initial * (scale / working_scale), 0);
+    frames_since_full = 0;
+    num_initial_fg = points_normalized.size();
+    num_inliers = num_initial_fg;
+
+    FILE_LOG(logDEBUG) << "CMT::initializeFromSnapshot() return";
+
+    return true;
 }
 
-void CMT::processFrame(Mat im_gray) {
+void CMT::processFrame(Mat im_gray_input) {
 
     FILE_LOG(logDEBUG) << "CMT::processFrame() call";
 
+    Mat im_gray = toWorkingResolution(im_gray_input);
+
+    //Track keypoints and detect keypoints/compute descriptors concurrently
+    vector<Point2f> points_tracked;
+    vector<unsigned char> status;
+    vector<KeyPoint> keypoints;
+    Mat descriptors;
+    Rect roi = detectionRegion(im_gray.size());
+    parallel_for_(Range(0, 2), TrackAndDetect(tracker, pyr_prev, pyr_gray, im_gray, roi, points_active, detector, descriptor,
+                points_tracked, status, keypoints, descriptors));
+
+    processKeypoints(points_tracked, status, keypoints, descriptors);
+
+    //Report the bounding box in input resolution
+    bb_rot = scaleRotatedRect(bb_rot, 1 / working_scale);
+
+    //Remember current image and its pyramid, the old pyramid's buffers are reused in the next frame
+    im_prev = im_gray;
+    pyr_prev.swap(pyr_gray);
+
+    FILE_LOG(logDEBUG) << "CMT::processFrame() return";
+}
+
+void CMT::processFrame(const vector<Mat> & pyr_prev, const vector<Mat> & pyr_gray,
+        const vector<KeyPoint> & keypoints, const Mat descriptors)
+{
+    FILE_LOG(logDEBUG) << "CMT::processFrame() call";
+
     //Track keypoints
     vector<Point2f> points_tracked;
     vector<unsigned char> status;
-    tracker.track(im_prev, im_gray, points_active, points_tracked, status);
+    tracker.track(pyr_prev, pyr_gray, points_active, points_tracked, status);
+
+    processKeypoints(points_tracked, status, keypoints, descriptors);
+
+    FILE_LOG(logDEBUG) << "CMT::processFrame() return";
+}
+
+//Returns the region in which keypoints are detected.
+//This is the previous bounding box with a margin, as matchLocal() only uses keypoints close to the object.
+//The whole image is searched regularly and whenever the object is about to be lost,
+//so that matchGlobal() can still find the object elsewhere.
+Rect CMT::detectionRegion(const Size size)
+{
+    Rect image(0, 0, size.width, size.height);
+
+    Rect bb = scaleRotatedRect(bb_rot, working_scale).boundingRect();
+
+    int margin_x = bb.width * roi_margin;
+    int margin_y = bb.height * roi_margin;
+    Rect roi = Rect(bb.x - margin_x, bb.y - margin_y, bb.width + 2 * margin_x, bb.height + 2 * margin_y) & image;
+
+    //An empty region means that the object has left the image or has been lost altogether
+    bool collapse = num_inliers < thr_roi_inliers * num_initial_fg || roi.area() <= 0;
+    bool scheduled = ++frames_since_full >= full_frame_interval;
+
+    if (!detect_roi || collapse || scheduled)
+    {
+        if (detect_roi && collapse) num_frames_collapse++;
+        num_frames_full++;
+        frames_since_full = 0;
+
+        FILE_LOG(logDEBUG) << "Detecting in whole image.";
+
+        return image;
+    }
+
+    num_frames_roi++;
+
+    FILE_LOG(logDEBUG) << "Detecting in region " << roi.x << "," << roi.y << "," << roi.width << "," << roi.height;
+
+    return roi;
+}
+
+void CMT::processKeypoints(const vector<Point2f> & points_tracked, const vector<unsigned char> & status,
+        const vector<KeyPoint> & keypoints, const Mat descriptors)
+{
+    FILE_LOG(logDEBUG) << "CMT::processKeypoints() call";
 
     FILE_LOG(logDEBUG) << points_tracked.size() << " tracked points.";
+    FILE_LOG(logDEBUG) << keypoints.size() << " keypoints found.";
 
     //keep only successful classes
     vector<int> classes_tracked;
@@ -122,15 +423,6 @@ void CMT::processFrame(Mat im_gray) {
 
     }
 
-    //Detect keypoints, compute descriptors
-    vector<KeyPoint> keypoints;
-    detector->detect(im_gray, keypoints);
-
-    FILE_LOG(logDEBUG) << keypoints.size() << " keypoints found.";
-
-    Mat descriptors;
-    descriptor->compute(im_gray, keypoints, descriptors);
-
     //Match keypoints globally
     vector<Point2f> points_matched_global;
     vector<int> classes_matched_global;
@@ -161,6 +453,8 @@ void CMT::processFrame(Mat im_gray) {
             center, points_inlier, classes_inlier);
 
     FILE_LOG(logDEBUG) << points_inlier.size() << " inlier points.";
+
+    num_inliers = points_inlier.size();
     FILE_LOG(logDEBUG) << "center " << center;
 
     //Match keypoints locally
@@ -184,10 +478,7 @@ void CMT::processFrame(Mat im_gray) {
     //TODO: Use theta to suppress result
     bb_rot = RotatedRect(center,  size_initial * scale, rotation/CV_PI * 180);
 
-    //Remember current image
-    im_prev = im_gray;
-
-    FILE_LOG(logDEBUG) << "CMT::processFrame() return";
+    FILE_LOG(logDEBUG) << "CMT::processKeypoints() return";
 }
 
 } /* namespace CMT */
@@ -22,10 +22,23 @@ namespace cmt
 class CMT
 {
 public:
-    CMT() : str_detector("FAST"), str_descriptor("BRISK") {};
+    CMT() : str_detector("FAST"), str_descriptor("BRISK"), detect_roi(true), roi_margin(0.5), full_frame_interval(10),
+        thr_roi_inliers(0.1), num_frames_roi(0), num_frames_full(0), num_frames_collapse(0),
+        auto_resolution(false), working_size(150), working_scale(1),
+        frames_since_full(0), num_inliers(0), num_initial_fg(0), im_work_current(0) {};
     void initialize(const Mat im_gray, const Rect rect);
     void processFrame(const Mat im_gray);
 
+    //Model snapshots, see Snapshot.h. Initialization from a snapshot skips detection in the first image,
+    //the object is assumed to be at rect, with the same aspect ratio as in the snapshot.
+    bool saveSnapshot(const string & path) const;
+    bool initializeFromSnapshot(const Mat im_gray, const Rect rect, const string & path);
+
+    //Variants for keypoints and pyramids that are shared between several trackers, see MultiCMT
+    void initialize(const Rect rect, const vector<KeyPoint> & keypoints, const Mat descriptors);
+    void processFrame(const vector<Mat> & pyr_prev, const vector<Mat> & pyr_gray,
+            const vector<KeyPoint> & keypoints, const Mat descriptors);
+
     Fusion fusion;
     Matcher matcher;
     Tracker tracker;
@@ -34,10 +47,32 @@ public:
     string str_detector;
     string str_descriptor;
 
-    vector<Point2f> points_active; //public for visualization purposes
-    RotatedRect bb_rot;
+    //Detect keypoints only around the previous bounding box, see processFrame()
+    bool detect_roi;
+    float roi_margin; //Added around the bounding box on each side, relative to its size
+    int full_frame_interval; //Detect in the whole image at least every so many frames
+    float thr_roi_inliers; //Detect in the whole image when fewer inliers than this fraction of initial points remain
+
+    //Statistics of region of interest detection
+    int64 num_frames_roi;
+    int64 num_frames_full;
+    int64 num_frames_collapse; //Full frame detections caused by too few inliers
+
+    //Process images at a lower resolution, chosen so that the initial bounding box has an area of about working_size^2
+    bool auto_resolution;
+    float working_size;
+    float working_scale; //Working resolution relative to the input images
+
+    vector<Point2f> points_active; //public for visualization purposes, in working resolution
+    RotatedRect bb_rot; //In input resolution
 
 private:
+    void processKeypoints(const vector<Point2f> & points_tracked, const vector<unsigned char> & status,
+            const vector<KeyPoint> & keypoints, const Mat descriptors);
+    Rect detectionRegion(const Size size);
+    void chooseWorkingScale(const Rect rect);
+    Mat toWorkingResolution(const Mat im_gray);
+
     Ptr<FeatureDetector> detector;
     Ptr<DescriptorExtractor> descriptor;
 
@@ -45,9 +80,21 @@ private:
 
     vector<int> classes_active;
 
+    int frames_since_full;
+    size_t num_inliers;
+    size_t num_initial_fg;
+
+    //Downscaled images are written alternately into these, as im_prev refers to the previous one
+    Mat ims_work[2];
+    int im_work_current;
+
     float theta;
 
     Mat im_prev;
+
+    //Optical flow pyramids of im_prev and of the current image, swapped after every frame
+    vector<Mat> pyr_prev;
+    vector<Mat> pyr_gray;
 };
 
 } /* namespace CMT */
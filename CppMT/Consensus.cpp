@@ -1,15 +1,73 @@
 #include "Consensus.h"
 
 #define _USE_MATH_DEFINES //Necessary for M_PI to be available on Windows
+#include <algorithm>
 #include <cmath>
+#include <cstdlib>
 
 #include "fastcluster/fastcluster.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using cv::getTickCount;
+using cv::getTickFrequency;
+using std::lower_bound;
+using std::make_pair;
 using std::max_element;
 using std::distance;
+using std::pair;
+using std::sort;
 
 namespace cmt {
 
+//Computes the euclidean distances between (x,y) and the n points given by xs, ys
+static void distancesToPoint(const float x, const float y, const float * xs, const float * ys,
+        const size_t n, float * out)
+{
+    size_t j = 0;
+
+#ifdef __SSE2__
+    const __m128 x4 = _mm_set1_ps(x);
+    const __m128 y4 = _mm_set1_ps(y);
+
+    for (; j + 4 <= n; j += 4)
+    {
+        __m128 dx = _mm_sub_ps(x4, _mm_loadu_ps(xs + j));
+        __m128 dy = _mm_sub_ps(y4, _mm_loadu_ps(ys + j));
+        _mm_storeu_ps(out + j, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy))));
+    }
+#endif
+
+    for (; j < n; j++)
+    {
+        float dx = x - xs[j];
+        float dy = y - ys[j];
+        out[j] = sqrt(dx * dx + dy * dy);
+    }
+}
+
+//Union-find lookup with path halving
+static int findRoot(vector<int> & parent, int i)
+{
+    while (parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+
+    return i;
+}
+
+//Joins the sets of i and j, the smaller root becomes the root of both
+static void unionRoots(vector<int> & parent, int i, int j)
+{
+    int root_i = findRoot(parent, i);
+    int root_j = findRoot(parent, j);
+    if (root_i != root_j) parent[std::max(root_i, root_j)] = std::min(root_i, root_j);
+}
+
 void Consensus::initialize(const vector<Point2f> & points_normalized)
 {
     FILE_LOG(logDEBUG) << "Consensus::initialize() call";
@@ -41,13 +99,62 @@ void Consensus::initialize(const vector<Point2f> & points_normalized)
     FILE_LOG(logDEBUG) << "Consensus::initialize() return";
 }
 
+void Consensus::save(SnapshotWriter & writer) const
+{
+    writer.writeVector(points_normalized);
+    writer.writeMat(distances_pairwise);
+    writer.writeMat(angles_pairwise);
+}
+
+//Restores the state of initialize() without recomputing the pairwise matrices
+void Consensus::load(SnapshotReader & reader)
+{
+    FILE_LOG(logDEBUG) << "Consensus::load() call";
+
+    reader.readVector(points_normalized);
+    reader.readMat(distances_pairwise);
+    reader.readMat(angles_pairwise);
+
+    //Both matrices are indexed by pairs of classes
+    size_t num_points = points_normalized.size();
+    for (int i = 0; i < 2; i++)
+    {
+        const Mat & m = i == 0 ? distances_pairwise : angles_pairwise;
+        if ((size_t) m.rows != num_points || (size_t) m.cols != num_points || (num_points > 0 && m.type() != CV_32F))
+        {
+            FILE_LOG(logERROR) << "Snapshot has inconsistent pairwise matrices";
+            reader.fail();
+            break;
+        }
+    }
+
+    FILE_LOG(logDEBUG) << "Consensus::load() return";
+}
+
 
-//TODO: Check for estimate_scale, estimate_rotation
 void Consensus::estimateScaleRotation(const vector<Point2f> & points, const vector<int> & classes,
         float & scale, float & rotation)
 {
     FILE_LOG(logDEBUG) << "Consensus::estimateScaleRotation() call";
 
+    int64 tic = getTickCount();
+
+    if (exact_scale_rotation) estimateScaleRotationExact(points, classes, scale, rotation);
+    else estimateScaleRotationFast(points, classes, scale, rotation);
+
+    time_scale_rotation = (getTickCount() - tic) * 1000. / getTickFrequency();
+
+    FILE_LOG(logDEBUG) << "Scale/rotation estimation took " << time_scale_rotation << " ms.";
+
+    FILE_LOG(logDEBUG) << "Consensus::estimateScaleRotation() return";
+}
+
+//TODO: Check for estimate_scale, estimate_rotation
+void Consensus::estimateScaleRotationExact(const vector<Point2f> & points, const vector<int> & classes,
+        float & scale, float & rotation)
+{
+    FILE_LOG(logDEBUG) << "Consensus::estimateScaleRotationExact() call";
+
     //Compute pairwise changes in scale/rotation
     vector<float> changes_scale;
     if (estimate_scale) changes_scale.reserve(points.size()*points.size());
@@ -78,7 +185,7 @@ void Consensus::estimateScaleRotation(const vector<Point2f> & points, const vect
 
                     //Fix long way angles
                     if (fabs(change_angle) > M_PI) {
-                        change_angle = sgn(change_angle) * 2 * M_PI + change_angle;
+                        change_angle = change_angle - sgn(change_angle) * 2 * M_PI;
                     }
 
                     changes_angles.push_back(change_angle);
@@ -96,7 +203,115 @@ void Consensus::estimateScaleRotation(const vector<Point2f> & points, const vect
     if (changes_angles.size() < 2) rotation = 0;
     else rotation = median(changes_angles);
 
-    FILE_LOG(logDEBUG) << "Consensus::estimateScaleRotation() return";
+    FILE_LOG(logDEBUG) << "Consensus::estimateScaleRotationExact() return";
+}
+
+//Computes the same estimate as estimateScaleRotationExact(), but only visits each unordered pair once.
+//The ordered pairs (i,j) and (j,i) yield identical changes in scale and rotation,
+//so the median over the upper triangle is the same as the median over all pairs.
+void Consensus::estimateScaleRotationFast(const vector<Point2f> & points, const vector<int> & classes,
+        float & scale, float & rotation)
+{
+    FILE_LOG(logDEBUG) << "Consensus::estimateScaleRotationFast() call";
+
+    size_t num_points = points.size();
+    size_t num_pairs = num_points > 1 ? num_points * (num_points - 1) / 2 : 0;
+
+    //Copy points into separate coordinate arrays so that the inner loops can be vectorized
+    xs.resize(num_points);
+    ys.resize(num_points);
+    cs.resize(num_points);
+
+    //Duplicate classes are rare, so only check for them once instead of in the inner loops
+    class_seen.assign(distances_pairwise.rows, 0);
+    bool has_duplicates = false;
+
+    for (size_t i = 0; i < num_points; i++)
+    {
+        xs[i] = points[i].x;
+        ys[i] = points[i].y;
+        cs[i] = classes[i];
+
+        if (class_seen[classes[i]]) has_duplicates = true;
+        class_seen[classes[i]] = 1;
+    }
+
+    pairs_scale.resize(estimate_scale ? num_pairs : 0);
+    pairs_angles.resize(estimate_rotation ? num_pairs : 0);
+
+    size_t index = 0;
+    for (size_t i = 0; i + 1 < num_points; i++)
+    {
+        const float xi = xs[i];
+        const float yi = ys[i];
+        const float * dist_row = distances_pairwise.ptr<float>(cs[i]);
+        const float * angle_row = angles_pairwise.ptr<float>(cs[i]);
+
+        const float * xj = &xs[i+1];
+        const float * yj = &ys[i+1];
+        const int * cj = &cs[i+1];
+        const size_t n = num_points - i - 1;
+
+        if (estimate_scale)
+        {
+            float * out = &pairs_scale[index];
+            for (size_t j = 0; j < n; j++)
+            {
+                float dx = xi - xj[j];
+                float dy = yi - yj[j];
+                out[j] = sqrt(dx * dx + dy * dy) / dist_row[cj[j]];
+            }
+        }
+
+        if (estimate_rotation)
+        {
+            float * out = &pairs_angles[index];
+            for (size_t j = 0; j < n; j++)
+            {
+                out[j] = atan2(yi - yj[j], xi - xj[j]) - angle_row[cj[j]];
+            }
+
+            for (size_t j = 0; j < n; j++)
+            {
+                //Fix long way angles
+                if (fabs(out[j]) > M_PI) {
+                    out[j] = out[j] - sgn(out[j]) * 2 * M_PI;
+                }
+            }
+        }
+
+        index += n;
+    }
+
+    //Remove the pairs of points that share the same class
+    if (has_duplicates)
+    {
+        size_t index_in = 0;
+        size_t index_out = 0;
+        for (size_t i = 0; i + 1 < num_points; i++)
+        {
+            for (size_t j = i+1; j < num_points; j++, index_in++)
+            {
+                if (cs[i] == cs[j]) continue;
+
+                if (estimate_scale) pairs_scale[index_out] = pairs_scale[index_in];
+                if (estimate_rotation) pairs_angles[index_out] = pairs_angles[index_in];
+                index_out++;
+            }
+        }
+
+        if (estimate_scale) pairs_scale.resize(index_out);
+        if (estimate_rotation) pairs_angles.resize(index_out);
+    }
+
+    //Every pair occurs once, so a single pair is already enough for an estimate
+    if (pairs_scale.size() < 1) scale = 1;
+    else scale = median(pairs_scale);
+
+    if (pairs_angles.size() < 1) rotation = 0;
+    else rotation = median(pairs_angles);
+
+    FILE_LOG(logDEBUG) << "Consensus::estimateScaleRotationFast() return";
 }
 
 void Consensus::findConsensus(const vector<Point2f> & points, const vector<int> & classes,
@@ -117,30 +332,65 @@ void Consensus::findConsensus(const vector<Point2f> & points, const vector<int>
     }
 
     //Compute votes
-    vector<Point2f> votes(points.size());
-    for (size_t i = 0; i < points.size(); i++)
+    size_t num_points = points.size();
+    votes.resize(num_points);
+    votes_x.resize(num_points);
+    votes_y.resize(num_points);
+    for (size_t i = 0; i < num_points; i++)
     {
         votes[i] = points[i] - scale * rotate(points_normalized[classes[i]], rotation);
+        votes_x[i] = votes[i].x;
+        votes_y[i] = votes[i].y;
     }
 
-    t_index N = points.size();
+    //Assign a cluster label to every vote and find the label of the largest cluster
+    int label_max;
+    if (cluster_grid) label_max = clusterVotesGrid();
+    else label_max = clusterVotesMST();
 
-    float * D = new float[N*(N-1)/2]; //This is a lot of memory, so we put it on the heap
-    cluster_result Z(N-1);
+    //Find inliers, compute center of votes
+    points_inlier.reserve(cluster_sizes[label_max]);
+    classes_inlier.reserve(cluster_sizes[label_max]);
+    center.x = center.y = 0;
 
-    //Compute pairwise distances between votes
-    int index = 0;
-    for (size_t i = 0; i < points.size(); i++)
+    for (size_t i = 0; i < num_points; i++)
     {
-        for (size_t j = i+1; j < points.size(); j++)
+        //If point is in consensus cluster
+        if (labels[i] == label_max)
         {
-            //TODO: This index calculation is correct, but is it a good thing?
-            //int index = i * (points.size() - 1) - (i*i + i) / 2 + j - 1;
-            D[index] = norm(votes[i] - votes[j]);
-            index++;
+            points_inlier.push_back(points[i]);
+            classes_inlier.push_back(classes[i]);
+            center.x += votes[i].x;
+            center.y += votes[i].y;
         }
+
     }
 
+    center.x /= points_inlier.size();
+    center.y /= points_inlier.size();
+
+    FILE_LOG(logDEBUG) << "Consensus::findConsensus() return";
+}
+
+//Single-linkage clustering of the votes via the minimum spanning tree, cut at thr_cutoff
+int Consensus::clusterVotesMST()
+{
+    t_index N = votes.size();
+
+    //Condensed matrix of pairwise distances between votes, at least one element so that D is valid
+    distances_votes.resize(std::max<size_t>(N*(N-1)/2, 1));
+    t_float * D = &distances_votes[0];
+
+    //Compute pairwise distances between votes, one row of the condensed matrix at a time
+    size_t index = 0;
+    for (t_index i = 0; i < N; i++)
+    {
+        distancesToPoint(votes_x[i], votes_y[i], &votes_x[0] + i + 1, &votes_y[0] + i + 1, N - i - 1, D + index);
+        index += N - i - 1;
+    }
+
+    cluster_result Z(N-1);
+
     FILE_LOG(logDEBUG) << "Consensus::MST_linkage_core() call";
     MST_linkage_core(N,D,Z);
     FILE_LOG(logDEBUG) << "Consensus::MST_linkage_core() return";
@@ -150,15 +400,9 @@ void Consensus::findConsensus(const vector<Point2f> & points, const vector<int>
     //Sort linkage by distance ascending
     std::stable_sort(Z[0], Z[N-1]);
 
-    //S are cluster sizes
-    int * S = new int[2*N-1];
-    //TODO: Why does this loop go to 2*N-1? Shouldn't it be simply N? Everything > N gets overwritten later
-    for(int i = 0; i < 2*N-1; i++)
-    {
-        S[i] = 1;
-    }
+    //Cluster sizes, indexed by union-find node
+    cluster_sizes.assign(2*N-1, 1);
 
-    t_index parent = 0; //After the loop ends, parent contains the index of the last cluster
     for (node const * NN=Z[0]; NN!=Z[N-1]; ++NN)
     {
         // Get two data points whose clusters are merged in step i.
@@ -171,47 +415,205 @@ void Consensus::findConsensus(const vector<Point2f> & points, const vector<int>
         // if the distance is appropriate
         if (NN->dist < thr_cutoff)
         {
-            parent = nodes.Union(node1, node2);
-            S[parent] = S[node1] + S[node2];
+            t_index parent = nodes.Union(node1, node2);
+            cluster_sizes[parent] = cluster_sizes[node1] + cluster_sizes[node2];
         }
     }
 
     //Get cluster labels
-    int * T = new int[N];
+    labels.resize(N);
     for (t_index i = 0; i < N; i++)
     {
-        T[i] = nodes.Find(i);
+        labels[i] = nodes.Find(i);
     }
 
     //Find largest cluster
-    int S_max = distance(S, max_element(S, S + 2*N-1));
+    return distance(cluster_sizes.begin(), max_element(cluster_sizes.begin(), cluster_sizes.end()));
+}
 
-    //Find inliers, compute center of votes
-    points_inlier.reserve(S[S_max]);
-    classes_inlier.reserve(S[S_max]);
-    center.x = center.y = 0;
+//Connected components of the graph that links votes closer than thr_cutoff.
+//This yields the same clusters as cutting the single-linkage tree. The votes are bucketed into a grid
+//whose cells have a diagonal of thr_cutoff, so all votes of a cell belong to one cluster without comparing them.
+//Votes of neighbouring cells are only compared until the first pair closer than thr_cutoff joins both cells.
+int Consensus::clusterVotesGrid()
+{
+    size_t N = votes.size();
 
-    for (size_t i = 0; i < points.size(); i++)
+    //Slightly less than thr_cutoff / sqrt(2), so that rounding can not put votes thr_cutoff apart into one cell
+    float cell_size = thr_cutoff * (float) (sqrt(0.5) * (1 - 1e-6));
+
+    //Bucket votes into grid cells by sorting them by cell
+    cells.resize(N);
+    for (size_t i = 0; i < N; i++)
     {
-        //If point is in consensus cluster
-        if (T[i] == S_max)
+        int cx = cvFloor(votes_x[i] / cell_size);
+        int cy = cvFloor(votes_y[i] / cell_size);
+        cells[i] = make_pair(gridCellKey(cx, cy), (int) i);
+    }
+
+    sort(cells.begin(), cells.end());
+
+    //Every vote starts out in its own cluster, the votes of a cell are joined right away
+    labels.resize(N);
+    for (size_t i = 0; i < N; i++)
+    {
+        labels[i] = i;
+    }
+
+    for (size_t k = 1; k < N; k++)
+    {
+        if (cells[k].first == cells[k-1].first) unionRoots(labels, cells[k].second, cells[k-1].second);
+    }
+
+    //Visit every cell once, by its first vote in sorted order
+    for (size_t k = 0; k < N; k = cellEnd(k))
+    {
+        size_t end = cellEnd(k);
+        int i = cells[k].second;
+        int cx = cvFloor(votes_x[i] / cell_size);
+        int cy = cvFloor(votes_y[i] / cell_size);
+
+        //Votes closer than thr_cutoff lie at most two cells apart. As cells are slightly smaller than
+        //thr_cutoff / sqrt(2), even the corner cells two apart in both directions are closer than thr_cutoff,
+        //so they are checked like all others. Every pair of cells only needs to be checked once,
+        //so only cells with a larger key are visited.
+        for (int ox = -2; ox <= 2; ox++)
         {
-            points_inlier.push_back(points[i]);
-            classes_inlier.push_back(classes[i]);
-            center.x += votes[i].x;
-            center.y += votes[i].y;
+            for (int oy = -2; oy <= 2; oy++)
+            {
+                int64 key = gridCellKey(cx + ox, cy + oy);
+                if (key <= cells[k].first) continue;
+
+                vector<pair<int64, int> >::const_iterator it =
+                    lower_bound(cells.begin() + end, cells.end(), make_pair(key, 0));
+                if (it == cells.end() || it->first != key) continue;
+
+                size_t other = it - cells.begin();
+                if (findRoot(labels, i) == findRoot(labels, cells[other].second)) continue;
+
+                if (cellsTouch(k, end, other, cellEnd(other))) unionRoots(labels, i, cells[other].second);
+            }
         }
+    }
 
+    //Get cluster labels and sizes
+    cluster_sizes.assign(N, 0);
+    for (size_t i = 0; i < N; i++)
+    {
+        labels[i] = findRoot(labels, i);
+        cluster_sizes[labels[i]]++;
     }
 
-    center.x /= points_inlier.size();
-    center.y /= points_inlier.size();
+    //Find largest cluster
+    int label_max = distance(cluster_sizes.begin(), max_element(cluster_sizes.begin(), cluster_sizes.end()));
 
-    delete[] D;
-	delete[] S;
-	delete[] T;
+    //Break ties like clusterVotesMST(), which labels clusters in the order of their last merge.
+    //That is the one whose spanning tree has the shortest longest edge, up to exact ties of this distance.
+    if (cluster_sizes[label_max] > 1)
+    {
+        float bottleneck_max = clusterBottleneck(label_max);
 
-    FILE_LOG(logDEBUG) << "Consensus::findConsensus() return";
+        for (size_t label = label_max + 1; label < N; label++)
+        {
+            if (cluster_sizes[label] != cluster_sizes[label_max]) continue;
+
+            float bottleneck = clusterBottleneck(label);
+            if (bottleneck < bottleneck_max)
+            {
+                label_max = label;
+                bottleneck_max = bottleneck;
+            }
+        }
+    }
+
+    return label_max;
+}
+
+//Returns the end of the run of votes in sorted cells that starts at k
+size_t Consensus::cellEnd(const size_t k) const
+{
+    size_t end = k + 1;
+    while (end < cells.size() && cells[end].first == cells[k].first) end++;
+    return end;
+}
+
+//Checks whether any vote of cells[begin1, end1) is closer than thr_cutoff to any vote of cells[begin2, end2)
+bool Consensus::cellsTouch(const size_t begin1, const size_t end1, const size_t begin2, const size_t end2)
+{
+    //Gather the votes of the second cell, so that their distances can be computed in one go
+    cell_x.resize(end2 - begin2);
+    cell_y.resize(end2 - begin2);
+    for (size_t k = begin2; k < end2; k++)
+    {
+        cell_x[k - begin2] = votes_x[cells[k].second];
+        cell_y[k - begin2] = votes_y[cells[k].second];
+    }
+
+    distances_cell.resize(end2 - begin2);
+
+    for (size_t k = begin1; k < end1; k++)
+    {
+        int i = cells[k].second;
+        distancesToPoint(votes_x[i], votes_y[i], &cell_x[0], &cell_y[0], cell_x.size(), &distances_cell[0]);
+
+        for (size_t j = 0; j < distances_cell.size(); j++)
+        {
+            if (distances_cell[j] < thr_cutoff) return true;
+        }
+    }
+
+    return false;
+}
+
+//Longest edge of the minimum spanning tree of the votes with the given label, found with Prim's algorithm
+float Consensus::clusterBottleneck(const int label)
+{
+    cell_x.clear();
+    cell_y.clear();
+    for (size_t i = 0; i < labels.size(); i++)
+    {
+        if (labels[i] == label)
+        {
+            cell_x.push_back(votes_x[i]);
+            cell_y.push_back(votes_y[i]);
+        }
+    }
+
+    size_t n = cell_x.size();
+
+    //Distance of every vote to the tree, which initially consists of the first vote
+    vector<float> distances_tree(n);
+    distancesToPoint(cell_x[0], cell_y[0], &cell_x[0], &cell_y[0], n, &distances_tree[0]);
+    vector<unsigned char> in_tree(n, 0);
+    in_tree[0] = 1;
+
+    distances_cell.resize(n);
+
+    float bottleneck = 0;
+    for (size_t step = 1; step < n; step++)
+    {
+        size_t next = 0;
+        float next_distance = numeric_limits<float>::infinity();
+        for (size_t j = 0; j < n; j++)
+        {
+            if (!in_tree[j] && distances_tree[j] < next_distance)
+            {
+                next = j;
+                next_distance = distances_tree[j];
+            }
+        }
+
+        bottleneck = std::max(bottleneck, next_distance);
+        in_tree[next] = 1;
+
+        distancesToPoint(cell_x[next], cell_y[next], &cell_x[0], &cell_y[0], n, &distances_cell[0]);
+        for (size_t j = 0; j < n; j++)
+        {
+            distances_tree[j] = std::min(distances_tree[j], distances_cell[j]);
+        }
+    }
+
+    return bottleneck;
 }
 
 } /* namespace cmt */
@@ -3,29 +3,69 @@
 #define CONSENSUS_H
 
 #include "common.h"
+#include "Snapshot.h"
 
 namespace cmt {
 
 class Consensus
 {
 public:
-    Consensus() : estimate_scale(true), estimate_rotation(false), thr_cutoff(20) {};
+    Consensus() : estimate_scale(true), estimate_rotation(false), exact_scale_rotation(false),
+        cluster_grid(false), time_scale_rotation(0), thr_cutoff(20) {};
 
     void initialize(const vector<Point2f> & points_normalized);
+    void save(SnapshotWriter & writer) const;
+    void load(SnapshotReader & reader);
     void estimateScaleRotation(const vector<Point2f> & points, const vector<int> & classes,
             float & scale, float & rotation);
+    void estimateScaleRotationExact(const vector<Point2f> & points, const vector<int> & classes,
+            float & scale, float & rotation);
+    void estimateScaleRotationFast(const vector<Point2f> & points, const vector<int> & classes,
+            float & scale, float & rotation);
     void findConsensus(const vector<Point2f> & points, const vector<int> & classes,
             const float scale, const float rotation,
             Point2f & center, vector<Point2f> & points_inlier, vector<int> & classes_inlier);
 
+    const vector<Point2f> & pointsNormalized() const { return points_normalized; };
+
     bool estimate_scale;
     bool estimate_rotation;
+    bool exact_scale_rotation; //Use the original estimator over all N^2 ordered pairs
+    bool cluster_grid; //Cluster votes by grid-bucketed connected components instead of the full MST
+
+    double time_scale_rotation; //Duration of the last estimateScaleRotation() call in ms
 
 private:
+    int clusterVotesMST();
+    int clusterVotesGrid();
+    size_t cellEnd(const size_t k) const;
+    bool cellsTouch(const size_t begin1, const size_t end1, const size_t begin2, const size_t end2);
+    float clusterBottleneck(const int label);
+
     float thr_cutoff;
     vector<Point2f> points_normalized;
     Mat distances_pairwise;
     Mat angles_pairwise;
+
+    //Scratch buffers of estimateScaleRotationFast(), kept across frames
+    vector<float> xs;
+    vector<float> ys;
+    vector<int> cs;
+    vector<unsigned char> class_seen;
+    vector<float> pairs_scale;
+    vector<float> pairs_angles;
+
+    //Scratch buffers of findConsensus(), kept across frames
+    vector<Point2f> votes;
+    vector<float> votes_x;
+    vector<float> votes_y;
+    vector<float> distances_votes;
+    vector<int> cluster_sizes;
+    vector<int> labels;
+    vector<std::pair<int64, int> > cells;
+    vector<float> cell_x;
+    vector<float> cell_y;
+    vector<float> distances_cell;
 };
 
 } /* namespace cmt */
@@ -0,0 +1,78 @@
+#include "FrameReader.h"
+
+using cv::imread;
+
+namespace cmt {
+
+FrameReader::~FrameReader()
+{
+    wait();
+}
+
+void FrameReader::start(VideoCapture * cap, const string & path)
+{
+    //Only one frame is read at a time
+    wait();
+
+    this->cap = cap;
+    this->path = path;
+    frame = Mat();
+
+#ifdef _WIN32
+    thread = CreateThread(NULL, 0, run, this, 0, NULL);
+    running = thread != NULL;
+#else
+    running = pthread_create(&thread, NULL, run, this) == 0;
+#endif
+
+    //Without a thread the frame is read right away
+    if (!running) read();
+}
+
+Mat FrameReader::wait()
+{
+    if (running)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+#else
+        pthread_join(thread, NULL);
+#endif
+        running = false;
+    }
+
+    return frame;
+}
+
+void FrameReader::read()
+{
+    if (cap != NULL)
+    {
+        //The capture may reuse its buffer for the following frame, so keep a copy
+        Mat im;
+        *cap >> im;
+        frame = im.clone();
+    }
+
+    else if (!path.empty())
+    {
+        frame = imread(path);
+    }
+}
+
+#ifdef _WIN32
+DWORD WINAPI FrameReader::run(LPVOID arg)
+{
+    static_cast<FrameReader *>(arg)->read();
+    return 0;
+}
+#else
+void * FrameReader::run(void * arg)
+{
+    static_cast<FrameReader *>(arg)->read();
+    return NULL;
+}
+#endif
+
+} /* namespace CMT */
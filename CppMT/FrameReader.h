@@ -0,0 +1,52 @@
+#ifndef FRAMEREADER_H
+
+#define FRAMEREADER_H
+
+#include "common.h"
+
+#include <opencv2/highgui/highgui.hpp>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+using cv::VideoCapture;
+
+namespace cmt {
+
+//Reads and decodes the next frame on a thread of its own, so that the frame can be processed meanwhile.
+//The thread is not part of OpenCV's pool, hence parallel_for_ calls made during processing are not nested.
+class FrameReader
+{
+public:
+    FrameReader() : running(false), cap(NULL) {};
+    ~FrameReader();
+
+    //Starts reading the next frame from cap if given, otherwise from path if it is not empty
+    void start(VideoCapture * cap, const string & path);
+
+    //Waits until the frame is read and returns it, the result is empty at the end of the stream
+    Mat wait();
+
+private:
+    void read();
+
+#ifdef _WIN32
+    static DWORD WINAPI run(LPVOID arg);
+    HANDLE thread;
+#else
+    static void * run(void * arg);
+    pthread_t thread;
+#endif
+
+    bool running;
+    VideoCapture * cap;
+    string path;
+    Mat frame;
+};
+
+} /* namespace CMT */
+
+#endif /* end of include guard: FRAMEREADER_H */
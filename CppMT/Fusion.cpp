@@ -2,6 +2,15 @@
 
 namespace cmt {
 
+void Fusion::initialize(const int num_classes)
+{
+    FILE_LOG(logDEBUG) << "Fusion::initialize() call";
+
+    class_present.assign(num_classes, 0);
+
+    FILE_LOG(logDEBUG) << "Fusion::initialize() return";
+}
+
 void Fusion::preferFirst(const vector<Point2f> & points_first, const vector<int> & classes_first,
     const vector<Point2f> & points_second, const vector<int> & classes_second,
     vector<Point2f> & points_fused, vector<int> & classes_fused)
@@ -11,6 +20,46 @@ void Fusion::preferFirst(const vector<Point2f> & points_first, const vector<int>
     points_fused = points_first;
     classes_fused = classes_first;
 
+    //Mark the classes of the first points
+    for (size_t j = 0; j < classes_first.size(); j++)
+    {
+        int class_first = classes_first[j];
+        if (class_first >= (int) class_present.size()) class_present.resize(class_first + 1, 0);
+        class_present[class_first] = 1;
+    }
+
+    for (size_t i = 0; i < points_second.size(); i++)
+    {
+        int class_second = classes_second[i];
+
+        bool found = class_second < (int) class_present.size() && class_present[class_second];
+
+        if (!found)
+        {
+            points_fused.push_back(points_second[i]);
+            classes_fused.push_back(class_second);
+        }
+
+    }
+
+    //Unmark again, so that only the touched entries have to be reset
+    for (size_t j = 0; j < classes_first.size(); j++)
+    {
+        class_present[classes_first[j]] = 0;
+    }
+
+    FILE_LOG(logDEBUG) << "Fusion::preferFirst() return";
+}
+
+void Fusion::preferFirstReference(const vector<Point2f> & points_first, const vector<int> & classes_first,
+    const vector<Point2f> & points_second, const vector<int> & classes_second,
+    vector<Point2f> & points_fused, vector<int> & classes_fused) const
+{
+    FILE_LOG(logDEBUG) << "Fusion::preferFirstReference() call";
+
+    points_fused = points_first;
+    classes_fused = classes_first;
+
     for (size_t i = 0; i < points_second.size(); i++)
     {
         int class_second = classes_second[i];
@@ -30,7 +79,7 @@ void Fusion::preferFirst(const vector<Point2f> & points_first, const vector<int>
 
     }
 
-    FILE_LOG(logDEBUG) << "Fusion::preferFirst() return";
+    FILE_LOG(logDEBUG) << "Fusion::preferFirstReference() return";
 }
 
 } /* namespace cmt */
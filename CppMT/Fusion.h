@@ -9,9 +9,20 @@ namespace cmt {
 class Fusion
 {
 public:
+    void initialize(const int num_classes);
     void preferFirst(const vector<Point2f> & firstPoints, const vector<int> & firstClasses,
            const vector<Point2f> & secondPoints, const vector<int> & secondClasses,
            vector<Point2f> & fusedPoints, vector<int> & fusedClasses);
+
+    //Original implementation of preferFirst(), which compares every pair of classes.
+    //Kept as reference for benchmarks, it gives the same result.
+    void preferFirstReference(const vector<Point2f> & firstPoints, const vector<int> & firstClasses,
+           const vector<Point2f> & secondPoints, const vector<int> & secondClasses,
+           vector<Point2f> & fusedPoints, vector<int> & fusedClasses) const;
+
+private:
+    //Flags indexed by class, set for the classes of the first point set during preferFirst()
+    vector<unsigned char> class_present;
 };
 
 } /* namespace CMT */
@@ -1,7 +1,13 @@
 #include "Matcher.h"
 
+#include <algorithm>
+#include <climits>
+
 using cv::vconcat;
-using cv::DMatch;
+using std::lower_bound;
+using std::make_pair;
+using std::pair;
+using std::sort;
 
 namespace cmt {
 
@@ -37,9 +43,64 @@ void Matcher::initialize(const vector<Point2f> & pts_fg_norm, const Mat desc_fg,
     //Create descriptor matcher
     bfmatcher = DescriptorMatcher::create("BruteForce-Hamming");
 
+    if (use_index) buildIndex();
+
     FILE_LOG(logDEBUG) << "Matcher::initialize() return";
 }
 
+void Matcher::save(SnapshotWriter & writer) const
+{
+    writer.writeVector(pts_fg_norm);
+    writer.writeMat(database);
+    writer.writeVector(classes);
+
+    vector<int> sizes;
+    sizes.push_back(desc_length);
+    sizes.push_back(num_bg_points);
+    writer.writeVector(sizes);
+}
+
+//Restores the state of initialize(), the index is built anew if it is used
+void Matcher::load(SnapshotReader & reader)
+{
+    FILE_LOG(logDEBUG) << "Matcher::load() call";
+
+    reader.readVector(pts_fg_norm);
+    reader.readMat(database);
+    reader.readVector(classes);
+
+    vector<int> sizes;
+    reader.readVector(sizes);
+
+    //The records have to fit together, otherwise matching would index out of bounds
+    bool consistent = reader.good() && sizes.size() == 2 && (size_t) database.rows == classes.size()
+        && (database.empty() || database.type() == CV_8U) && sizes[0] == database.cols * 8
+        && sizes[1] >= 0 && sizes[1] <= database.rows
+        && pts_fg_norm.size() == (size_t) (database.rows - sizes[1]);
+
+    for (size_t i = 0; consistent && i < classes.size(); i++)
+    {
+        consistent = classes[i] >= -1 && classes[i] < (int) pts_fg_norm.size();
+    }
+
+    if (!consistent)
+    {
+        FILE_LOG(logERROR) << "Snapshot has an inconsistent matcher database";
+        reader.fail();
+        FILE_LOG(logDEBUG) << "Matcher::load() return";
+        return;
+    }
+
+    desc_length = sizes[0];
+    num_bg_points = sizes[1];
+
+    bfmatcher = DescriptorMatcher::create("BruteForce-Hamming");
+
+    if (use_index) buildIndex();
+
+    FILE_LOG(logDEBUG) << "Matcher::load() return";
+}
+
 void Matcher::matchGlobal(const vector<KeyPoint> & keypoints, const Mat descriptors,
         vector<Point2f> & points_matched, vector<int> & classes_matched)
 {
@@ -52,19 +113,52 @@ void Matcher::matchGlobal(const vector<KeyPoint> & keypoints, const Mat descript
     }
 
     vector<vector<DMatch> > matches;
-    bfmatcher->knnMatch(descriptors, database, matches, 2);
 
-    for (size_t i = 0; i < matches.size(); i++)
+    if (use_index)
+    {
+        matchIndex(descriptors, matches);
+    }
+
+    if (!use_index || check_recall)
     {
-        vector<DMatch> m = matches[i];
+        vector<vector<DMatch> > matches_bf;
+        bfmatcher->knnMatch(descriptors, database, matches_bf, 2);
+
+        //The index found a nearest neighbour if its distance is not larger
+        if (use_index)
+        {
+            for (size_t i = 0; i < matches.size(); i++)
+            {
+                const vector<DMatch> & m = matches[i];
+                const vector<DMatch> & m_bf = matches_bf[i];
+
+                if (m.size() > 0 && m[0].distance <= m_bf[0].distance)
+                {
+                    num_recalled++;
+                    if (m.size() > 1 && (m_bf.size() < 2 || m[1].distance <= m_bf[1].distance)) num_recalled2++;
+                }
+
+                if (acceptedClass(m) == acceptedClass(m_bf)) num_agreed++;
+            }
+
+            FILE_LOG(logINFO) << "Matcher::matchGlobal() radius " << index_radius
+                << " recall " << (float) num_recalled / num_queries
+                << ", 2-NN recall " << (float) num_recalled2 / num_queries
+                << ", ratio test agreement " << (float) num_agreed / num_queries
+                << ", compared " << (float) num_candidates / num_queries << " of " << database.rows << " descriptors per query";
+        }
 
-        float distance1 = m[0].distance / desc_length;
-        float distance2 = m[1].distance / desc_length;
-        int matched_class = classes[m[0].trainIdx];
+        else
+        {
+            matches.swap(matches_bf);
+        }
+    }
+
+    for (size_t i = 0; i < matches.size(); i++)
+    {
+        int matched_class = acceptedClass(matches[i]);
 
         if (matched_class == -1) continue;
-        if (distance1 > thr_dist) continue;
-        if (distance1/distance2 > thr_ratio) continue;
 
         points_matched.push_back(keypoints[i].pt);
         classes_matched.push_back(matched_class);
@@ -73,6 +167,132 @@ void Matcher::matchGlobal(const vector<KeyPoint> & keypoints, const Mat descript
     FILE_LOG(logDEBUG) << "Matcher::matchGlobal() return";
 }
 
+//Returns the foreground class of the nearest neighbour if it passes the distance and ratio test, -1 otherwise
+int Matcher::acceptedClass(const vector<DMatch> & m) const
+{
+    //The index might not find any candidates
+    if (m.size() < 2) return -1;
+
+    float distance1 = m[0].distance / desc_length;
+    float distance2 = m[1].distance / desc_length;
+
+    if (distance1 > thr_dist) return -1;
+    if (distance1/distance2 > thr_ratio) return -1;
+
+    return classes[m[0].trainIdx];
+}
+
+void Matcher::buildIndex()
+{
+    FILE_LOG(logDEBUG) << "Matcher::buildIndex() call";
+
+    int num_tables = database.cols / 2;
+
+    index_tables.assign(num_tables, vector<pair<unsigned short, int> >(database.rows));
+
+    for (int i = 0; i < database.rows; i++)
+    {
+        const uchar * desc = database.ptr<uchar>(i);
+
+        for (int t = 0; t < num_tables; t++)
+        {
+            index_tables[t][i] = make_pair((unsigned short) (desc[2*t] | desc[2*t+1] << 8), i);
+        }
+    }
+
+    for (int t = 0; t < num_tables; t++)
+    {
+        sort(index_tables[t].begin(), index_tables[t].end());
+    }
+
+    index_stamps.assign(database.rows, -1);
+
+    //Masks of the substrings to probe, ordered by the number of flipped bits
+    index_masks.clear();
+    for (int bits = 0; bits <= std::min(index_radius, 16); bits++)
+    {
+        for (int mask = 0; mask <= 0xFFFF; mask++)
+        {
+            int mask_bits = 0;
+            for (int m = mask; m != 0; m &= m - 1) mask_bits++;
+
+            if (mask_bits == bits) index_masks.push_back(mask);
+        }
+    }
+
+    FILE_LOG(logDEBUG) << "Matcher::buildIndex() return";
+}
+
+//Finds the two nearest neighbours among all database descriptors whose 16 bit substrings are within index_radius
+//of the query's in at least one table. By the pigeonhole principle, this includes every descriptor that differs in
+//fewer than (index_radius + 1) times the number of substrings bits. Neighbours further away are usually found as well,
+//but not always.
+void Matcher::matchIndex(const Mat descriptors, vector<vector<DMatch> > & matches)
+{
+    FILE_LOG(logDEBUG) << "Matcher::matchIndex() call";
+
+    int num_tables = index_tables.size();
+
+    matches.resize(descriptors.rows);
+
+    for (int i = 0; i < descriptors.rows; i++)
+    {
+        const uchar * desc = descriptors.ptr<uchar>(i);
+        //Stamps are query numbers, so they never need to be reset
+        int64 stamp = num_queries++;
+
+        int dist1 = INT_MAX;
+        int dist2 = INT_MAX;
+        int index1 = -1;
+        int index2 = -1;
+
+        for (int t = 0; t < num_tables; t++)
+        {
+            unsigned short substring = desc[2*t] | desc[2*t+1] << 8;
+
+            //Probe every substring within index_radius, the exact one first
+            for (size_t p = 0; p < index_masks.size(); p++)
+            {
+                unsigned short key = substring ^ index_masks[p];
+
+                vector<pair<unsigned short, int> >::const_iterator it =
+                    lower_bound(index_tables[t].begin(), index_tables[t].end(), make_pair(key, 0));
+
+                for (; it != index_tables[t].end() && it->first == key; ++it)
+                {
+                    int j = it->second;
+
+                    if (index_stamps[j] == stamp) continue;
+                    index_stamps[j] = stamp;
+                    num_candidates++;
+
+                    int dist = hammingDistance(desc, database.ptr<uchar>(j), database.cols);
+
+                    if (dist < dist1 || (dist == dist1 && j < index1))
+                    {
+                        dist2 = dist1;
+                        index2 = index1;
+                        dist1 = dist;
+                        index1 = j;
+                    }
+
+                    else if (dist < dist2 || (dist == dist2 && j < index2))
+                    {
+                        dist2 = dist;
+                        index2 = j;
+                    }
+                }
+            }
+        }
+
+        matches[i].clear();
+        if (index1 != -1) matches[i].push_back(DMatch(i, index1, dist1));
+        if (index2 != -1) matches[i].push_back(DMatch(i, index2, dist2));
+    }
+
+    FILE_LOG(logDEBUG) << "Matcher::matchIndex() return";
+}
+
 void Matcher::matchLocal(const vector<KeyPoint> & keypoints, const Mat descriptors,
         const Point2f center, const float scale, const float rotation,
         vector<Point2f> & points_matched, vector<int> & classes_matched)
@@ -85,53 +305,86 @@ void Matcher::matchLocal(const vector<KeyPoint> & keypoints, const Mat descripto
     }
 
     //Transform initial points
-    vector<Point2f> pts_fg_trans;
-    pts_fg_trans.reserve(pts_fg_norm.size());
-    for (size_t i = 0; i < pts_fg_norm.size(); i++)
+    size_t num_fg_points = pts_fg_norm.size();
+    pts_fg_trans.resize(num_fg_points);
+    for (size_t j = 0; j < num_fg_points; j++)
+    {
+        pts_fg_trans[j] = scale * rotate(pts_fg_norm[j], -rotation);
+    }
+
+    //Bucket transformed points into a grid with cell size thr_cutoff by sorting them by cell
+    cells_fg.resize(num_fg_points);
+    for (size_t j = 0; j < num_fg_points; j++)
     {
-        pts_fg_trans.push_back(scale * rotate(pts_fg_norm[i], -rotation));
+        int cx = cvFloor(pts_fg_trans[j].x / thr_cutoff);
+        int cy = cvFloor(pts_fg_trans[j].y / thr_cutoff);
+        cells_fg[j] = make_pair(gridCellKey(cx, cy), (int) j);
     }
 
+    sort(cells_fg.begin(), cells_fg.end());
+
     //Perform local matching
     for (size_t i = 0; i < keypoints.size(); i++)
     {
         //Normalize keypoint with respect to center
         Point2f location_rel = keypoints[i].pt - center;
 
-        //Find potential indices for matching
-        vector<int> indices_potential;
-        for (size_t j = 0; j < pts_fg_trans.size(); j++)
+        int cx = cvFloor(location_rel.x / thr_cutoff);
+        int cy = cvFloor(location_rel.y / thr_cutoff);
+
+        const uchar * desc = descriptors.ptr<uchar>(i);
+
+        //Find the two nearest descriptors among the potential matches.
+        //Ties are broken by index, just like the brute force matcher does.
+        int dist1 = INT_MAX;
+        int dist2 = INT_MAX;
+        int index1 = -1;
+
+        //Potential matches lie closer than thr_cutoff, so they are in the same or a neighbouring cell
+        for (int ox = -1; ox <= 1; ox++)
         {
-            float l2norm = norm(pts_fg_trans[j] - location_rel);
+            for (int oy = -1; oy <= 1; oy++)
+            {
+                int64 key = gridCellKey(cx + ox, cy + oy);
 
-            if (l2norm < thr_cutoff) {
-                indices_potential.push_back(num_bg_points + j);
-            }
+                vector<pair<int64, int> >::const_iterator it =
+                    lower_bound(cells_fg.begin(), cells_fg.end(), make_pair(key, 0));
 
-        }
+                for (; it != cells_fg.end() && it->first == key; ++it)
+                {
+                    int j = it->second;
 
-        //If there are no potential matches, continue
-        if (indices_potential.size() == 0) continue;
+                    float l2norm = norm(pts_fg_trans[j] - location_rel);
 
-        //Build descriptor matrix and classes from potential indices
-        Mat database_potential = Mat(indices_potential.size(), database.cols, database.type());
-        for (size_t j = 0; j < indices_potential.size(); j++) {
-            database.row(indices_potential[j]).copyTo(database_potential.row(j));
-        }
+                    if (l2norm >= thr_cutoff) continue;
+
+                    int dist = hammingDistance(desc, database.ptr<uchar>(num_bg_points + j), database.cols);
+
+                    if (dist < dist1 || (dist == dist1 && j < index1))
+                    {
+                        dist2 = dist1;
+                        dist1 = dist;
+                        index1 = j;
+                    }
 
-        //Find distances between descriptors
-        vector<vector<DMatch> > matches;
-        bfmatcher->knnMatch(descriptors.row(i), database_potential, matches, 2);
+                    else if (dist < dist2)
+                    {
+                        dist2 = dist;
+                    }
+                }
+            }
+        }
 
-        vector<DMatch> m = matches[0];
+        //If there are no potential matches, continue
+        if (index1 == -1) continue;
 
-        float distance1 = m[0].distance / desc_length;
-        float distance2 = m.size() > 1 ? m[1].distance / desc_length : 1;
+        float distance1 = (float) dist1 / desc_length;
+        float distance2 = dist2 != INT_MAX ? (float) dist2 / desc_length : 1;
 
         if (distance1 > thr_dist) continue;
         if (distance1/distance2 > thr_ratio) continue;
 
-        int matched_class = classes[indices_potential[m[0].trainIdx]];
+        int matched_class = classes[num_bg_points + index1];
 
         points_matched.push_back(keypoints[i].pt);
         classes_matched.push_back(matched_class);
@@ -3,28 +3,51 @@
 #define MATCHER_H
 
 #include "common.h"
+#include "Snapshot.h"
 
 #include "opencv2/features2d/features2d.hpp"
 
 using cv::KeyPoint;
 using cv::Ptr;
 using cv::DescriptorMatcher;
+using cv::DMatch;
 
 namespace cmt {
 
 class Matcher
 {
 public:
-    Matcher() : thr_dist(0.25), thr_ratio(0.8), thr_cutoff(20) {};
+    Matcher() : use_index(false), check_recall(false), index_radius(0), num_queries(0), num_recalled(0),
+        num_recalled2(0), num_agreed(0), num_candidates(0), thr_dist(0.25), thr_ratio(0.8), thr_cutoff(20) {};
     void initialize(const vector<Point2f> & pts_fg_norm, const Mat desc_fg, const vector<int> & classes_fg,
             const Mat desc_bg, const Point2f center);
+    void save(SnapshotWriter & writer) const;
+    void load(SnapshotReader & reader);
     void matchGlobal(const vector<KeyPoint> & keypoints, const Mat descriptors,
             vector<Point2f> & points_matched, vector<int> & classes_matched);
     void matchLocal(const vector<KeyPoint> & keypoints, const Mat descriptors,
             const Point2f center, const float scale, const float rotation,
             vector<Point2f> & points_matched, vector<int> & classes_matched);
 
+    const vector<Point2f> & pointsNormalized() const { return pts_fg_norm; };
+    const vector<int> & classesDatabase() const { return classes; };
+
+    bool use_index; //Match globally with the multi-index hash instead of brute force
+    bool check_recall; //Also match by brute force and count how often the index finds the nearest neighbour
+    int index_radius; //Substrings within this Hamming distance of the query's are probed in every table
+
+    //Statistics of the index, accumulated over all frames
+    int64 num_queries;
+    int64 num_recalled;
+    int64 num_recalled2; //Both nearest neighbours found
+    int64 num_agreed; //Distance and ratio test come to the same result as with brute force
+    int64 num_candidates; //Number of descriptors compared to the query
+
 private:
+    void buildIndex();
+    void matchIndex(const Mat descriptors, vector<vector<DMatch> > & matches);
+    int acceptedClass(const vector<DMatch> & m) const;
+
     vector<Point2f> pts_fg_norm;
     Mat database;
     vector<int> classes;
@@ -34,6 +57,16 @@ private:
     float thr_dist;
     float thr_ratio;
     float thr_cutoff;
+
+    //Scratch buffers of matchLocal(), kept across frames
+    vector<Point2f> pts_fg_trans;
+    vector<std::pair<int64, int> > cells_fg;
+
+    //Multi-index hash of the database: one table per 16 bit substring of the descriptors,
+    //sorted by the value of the substring
+    vector<vector<std::pair<unsigned short, int> > > index_tables;
+    vector<int64> index_stamps; //Last query each database row was compared to
+    vector<unsigned short> index_masks; //All 16 bit masks with at most index_radius bits set
 };
 
 } /* namespace CMT */
@@ -0,0 +1,118 @@
+#include "MultiCMT.h"
+
+using cv::parallel_for_;
+using cv::ParallelLoopBody;
+using cv::Range;
+
+namespace cmt {
+
+//Builds the pyramid of the current image and detects/describes keypoints as two concurrent tasks
+class BuildAndDetect : public ParallelLoopBody
+{
+public:
+    BuildAndDetect(Tracker & tracker, const Mat & im_gray, vector<Mat> & pyr_gray,
+            const Ptr<FeatureDetector> & detector, const Ptr<DescriptorExtractor> & descriptor,
+            vector<KeyPoint> & keypoints, Mat & descriptors) :
+        tracker(tracker), im_gray(im_gray), pyr_gray(pyr_gray), detector(detector), descriptor(descriptor),
+        keypoints(keypoints), descriptors(descriptors) {};
+
+    virtual void operator()(const Range & range) const
+    {
+        for (int i = range.start; i < range.end; i++)
+        {
+            if (i == 0)
+            {
+                tracker.buildPyramid(im_gray, pyr_gray);
+            }
+
+            else
+            {
+                detector->detect(im_gray, keypoints);
+                descriptor->compute(im_gray, keypoints, descriptors);
+            }
+        }
+    }
+
+private:
+    Tracker & tracker;
+    const Mat & im_gray;
+    vector<Mat> & pyr_gray;
+    const Ptr<FeatureDetector> & detector;
+    const Ptr<DescriptorExtractor> & descriptor;
+    vector<KeyPoint> & keypoints;
+    Mat & descriptors;
+};
+
+//Lets every target process the shared keypoints and pyramids
+class ProcessTargets : public ParallelLoopBody
+{
+public:
+    ProcessTargets(vector<CMT> & targets, const vector<Mat> & pyr_prev, const vector<Mat> & pyr_gray,
+            const vector<KeyPoint> & keypoints, const Mat & descriptors) :
+        targets(targets), pyr_prev(pyr_prev), pyr_gray(pyr_gray), keypoints(keypoints), descriptors(descriptors) {};
+
+    virtual void operator()(const Range & range) const
+    {
+        for (int i = range.start; i < range.end; i++)
+        {
+            targets[i].processFrame(pyr_prev, pyr_gray, keypoints, descriptors);
+        }
+    }
+
+private:
+    vector<CMT> & targets;
+    const vector<Mat> & pyr_prev;
+    const vector<Mat> & pyr_gray;
+    const vector<KeyPoint> & keypoints;
+    const Mat & descriptors;
+};
+
+void MultiCMT::initialize(const Mat im_gray, const vector<Rect> & rects)
+{
+    FILE_LOG(logDEBUG) << "MultiCMT::initialize() call";
+
+    if (targets.size() != rects.size()) targets.resize(rects.size());
+
+    //Initialize detector and descriptor
+    detector = FeatureDetector::create(str_detector);
+    descriptor = DescriptorExtractor::create(str_descriptor);
+
+    //Build the initial pyramid and get initial keypoints in whole image and their descriptors
+    vector<KeyPoint> keypoints;
+    Mat descriptors;
+    parallel_for_(Range(0, 2), BuildAndDetect(tracker, im_gray, pyr_prev, detector, descriptor,
+                keypoints, descriptors));
+
+    FILE_LOG(logDEBUG) << keypoints.size() << " keypoints found.";
+
+    //Every target splits the keypoints into foreground and background on its own
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        targets[i].initialize(rects[i], keypoints, descriptors);
+    }
+
+    FILE_LOG(logDEBUG) << "MultiCMT::initialize() return";
+}
+
+void MultiCMT::processFrame(const Mat im_gray)
+{
+    FILE_LOG(logDEBUG) << "MultiCMT::processFrame() call";
+
+    //Build the pyramid and detect keypoints/compute descriptors once for all targets
+    vector<KeyPoint> keypoints;
+    Mat descriptors;
+    parallel_for_(Range(0, 2), BuildAndDetect(tracker, im_gray, pyr_gray, detector, descriptor,
+                keypoints, descriptors));
+
+    FILE_LOG(logDEBUG) << keypoints.size() << " keypoints found.";
+
+    //Track and match every target in parallel
+    parallel_for_(Range(0, targets.size()), ProcessTargets(targets, pyr_prev, pyr_gray, keypoints, descriptors));
+
+    //Remember the current pyramid, the old pyramid's buffers are reused in the next frame
+    pyr_prev.swap(pyr_gray);
+
+    FILE_LOG(logDEBUG) << "MultiCMT::processFrame() return";
+}
+
+} /* namespace cmt */
@@ -0,0 +1,39 @@
+#ifndef MULTI_CMT_H
+
+#define MULTI_CMT_H
+
+#include "CMT.h"
+
+namespace cmt
+{
+
+//Tracks several objects in the same video.
+//Keypoints, descriptors and optical flow pyramids are computed once per frame and shared by all targets,
+//matching and consensus run per target in parallel.
+class MultiCMT
+{
+public:
+    MultiCMT() : str_detector("FAST"), str_descriptor("BRISK") {};
+
+    //Targets may be configured before initialization, otherwise one default CMT per rect is created
+    void initialize(const Mat im_gray, const vector<Rect> & rects);
+    void processFrame(const Mat im_gray);
+
+    vector<CMT> targets;
+
+    string str_detector;
+    string str_descriptor;
+
+private:
+    Ptr<FeatureDetector> detector;
+    Ptr<DescriptorExtractor> descriptor;
+
+    Tracker tracker; //Only used for building the pyramids
+
+    vector<Mat> pyr_prev;
+    vector<Mat> pyr_gray;
+};
+
+} /* namespace cmt */
+
+#endif /* end of include guard: MULTI_CMT_H */
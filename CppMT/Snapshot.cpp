@@ -0,0 +1,214 @@
+#include "Snapshot.h"
+
+#include <climits>
+#include <cstring>
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SNAPSHOT_MMAP
+#endif
+
+namespace cmt {
+
+//Records are padded to multiples of this
+static const size_t ALIGNMENT = 8;
+
+static size_t padded(const size_t length)
+{
+    return (length + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    if (file != NULL) fclose(file);
+}
+
+bool SnapshotWriter::open(const string & path)
+{
+    file = fopen(path.c_str(), "wb");
+    ok = file != NULL;
+
+    if (!ok) return false;
+
+    //Header: magic, version, byte order
+    unsigned int header[2] = {SNAPSHOT_VERSION, SNAPSHOT_BYTE_ORDER};
+    ok = fwrite(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC), 1, file) == 1 && fwrite(header, sizeof(header), 1, file) == 1;
+
+    return ok;
+}
+
+bool SnapshotWriter::close()
+{
+    if (file == NULL) return false;
+
+    ok = fclose(file) == 0 && ok;
+    file = NULL;
+
+    return ok;
+}
+
+void SnapshotWriter::writeRecord(const int64 a, const int b, const int c, const void * data, const size_t size)
+{
+    if (!ok) return;
+
+    int64 a_record = a;
+    int bc[2] = {b, c};
+    char padding[ALIGNMENT] = {0};
+
+    ok = fwrite(&a_record, sizeof(a_record), 1, file) == 1 && fwrite(bc, sizeof(bc), 1, file) == 1
+        && (size == 0 || fwrite(data, size, 1, file) == 1)
+        && (padded(size) == size || fwrite(padding, padded(size) - size, 1, file) == 1);
+}
+
+void SnapshotWriter::writeMat(const Mat & mat)
+{
+    //Only continuous data can be written in one piece
+    Mat m = mat.isContinuous() ? mat : mat.clone();
+
+    writeRecord(m.rows, m.cols, m.type(), m.data, m.rows * m.cols * m.elemSize());
+}
+
+void SnapshotWriter::writeString(const string & str)
+{
+    writeVector(vector<char>(str.begin(), str.end()));
+}
+
+SnapshotReader::~SnapshotReader()
+{
+#ifdef SNAPSHOT_MMAP
+    if (mapped) munmap((void *) data, size);
+#endif
+}
+
+bool SnapshotReader::open(const string & path)
+{
+    ok = false;
+
+#ifdef SNAPSHOT_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void * p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (p != MAP_FAILED)
+        {
+            data = (const char *) p;
+            size = st.st_size;
+            mapped = true;
+        }
+    }
+
+    ::close(fd);
+
+    if (!mapped) return false;
+#else
+    FILE * file = fopen(path.c_str(), "rb");
+    if (file == NULL) return false;
+
+    fseek(file, 0, SEEK_END);
+    buffer.resize(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    bool read = !buffer.empty() && fread(&buffer[0], buffer.size(), 1, file) == 1;
+    fclose(file);
+
+    if (!read) return false;
+
+    data = &buffer[0];
+    size = buffer.size();
+#endif
+
+    //Check header
+    offset = sizeof(SNAPSHOT_MAGIC) + 2 * sizeof(unsigned int);
+    if (size < offset || memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) return false;
+
+    unsigned int header[2];
+    memcpy(header, data + sizeof(SNAPSHOT_MAGIC), sizeof(header));
+
+    if (header[0] != SNAPSHOT_VERSION)
+    {
+        FILE_LOG(logERROR) << "Snapshot has version " << header[0] << ", expected " << SNAPSHOT_VERSION;
+        return false;
+    }
+
+    if (header[1] != SNAPSHOT_BYTE_ORDER)
+    {
+        FILE_LOG(logERROR) << "Snapshot was written with a different byte order";
+        return false;
+    }
+
+    ok = true;
+
+    return ok;
+}
+
+void SnapshotReader::readHeader(int64 & a, int & b, int & c)
+{
+    a = 0;
+    b = c = 0;
+
+    if (!ok || size - offset < sizeof(int64) + 2 * sizeof(int))
+    {
+        ok = false;
+        return;
+    }
+
+    memcpy(&a, data + offset, sizeof(int64));
+    memcpy(&b, data + offset + sizeof(int64), sizeof(int));
+    memcpy(&c, data + offset + sizeof(int64) + sizeof(int), sizeof(int));
+    offset += sizeof(int64) + 2 * sizeof(int);
+}
+
+const char * SnapshotReader::readBytes(const int64 length)
+{
+    if (!ok || length < 0 || (uint64) padded(length) > size - offset)
+    {
+        ok = false;
+        return NULL;
+    }
+
+    const char * p = data + offset;
+    offset += padded(length);
+
+    return p;
+}
+
+void SnapshotReader::readMat(Mat & mat)
+{
+    int64 rows;
+    int cols, type;
+    readHeader(rows, cols, type);
+
+    if (rows < 0 || rows > INT_MAX || cols < 0 || type != CV_MAT_TYPE(type)) ok = false;
+    if (!ok) return;
+
+    //Bound every factor by the remaining data before multiplying, so that the length can not overflow
+    uint64 remaining = size - offset;
+    uint64 elem_size = CV_ELEM_SIZE(type);
+    if ((uint64) cols > remaining / elem_size || (cols > 0 && (uint64) rows > remaining / (cols * elem_size)))
+    {
+        ok = false;
+        return;
+    }
+
+    const char * p = readBytes(rows * cols * elem_size);
+    if (p == NULL) return;
+
+    //Copy, so that the matrix outlives the mapping
+    if (rows == 0 || cols == 0) mat = Mat();
+    else Mat(rows, cols, type, (void *) p).copyTo(mat);
+}
+
+void SnapshotReader::readString(string & str)
+{
+    vector<char> v;
+    readVector(v);
+    str.assign(v.begin(), v.end());
+}
+
+} /* namespace cmt */
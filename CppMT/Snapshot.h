@@ -0,0 +1,96 @@
+#ifndef SNAPSHOT_H
+
+#define SNAPSHOT_H
+
+#include "common.h"
+
+#include <cstdio>
+
+namespace cmt {
+
+//Binary snapshot files of the CMT model.
+//A snapshot starts with a fixed header, followed by a sequence of records. Every record is a 16 byte
+//header (element count or rows/cols/type) followed by the raw data, padded to a multiple of 8 bytes.
+//All data is therefore aligned and can be used directly from a memory mapping of the file.
+const char SNAPSHOT_MAGIC[8] = {'C', 'M', 'T', 'S', 'N', 'A', 'P', '\0'};
+const unsigned int SNAPSHOT_VERSION = 1;
+const unsigned int SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+class SnapshotWriter
+{
+public:
+    SnapshotWriter() : file(NULL), ok(false) {};
+    ~SnapshotWriter();
+
+    bool open(const string & path);
+    bool close();
+
+    void writeMat(const Mat & mat);
+    void writeString(const string & str);
+
+    template<class T>
+    void writeVector(const vector<T> & v)
+    {
+        writeRecord(v.size(), sizeof(T), 0, v.empty() ? NULL : &v[0], v.size() * sizeof(T));
+    }
+
+private:
+    void writeRecord(const int64 a, const int b, const int c, const void * data, const size_t size);
+
+    FILE * file;
+    bool ok;
+};
+
+class SnapshotReader
+{
+public:
+    SnapshotReader() : data(NULL), size(0), offset(0), ok(false), mapped(false) {};
+    ~SnapshotReader();
+
+    //Maps the file into memory and checks its header
+    bool open(const string & path);
+
+    //All reads fail once a record does not fit, this is reported by good()
+    bool good() const { return ok; };
+
+    //Lets all further reads fail, for records that are well-formed but do not fit together
+    void fail() { ok = false; };
+
+    void readMat(Mat & mat);
+    void readString(string & str);
+
+    template<class T>
+    void readVector(vector<T> & v)
+    {
+        int64 count;
+        int elem_size, unused;
+        readHeader(count, elem_size, unused);
+        if (elem_size != (int) sizeof(T)) ok = false;
+
+        //Bound the count before multiplying, so that the length can not overflow
+        if (count < 0 || (uint64) count > (uint64) (size - offset) / sizeof(T))
+        {
+            ok = false;
+            return;
+        }
+
+        const char * p = readBytes(count * sizeof(T));
+        if (p == NULL) return;
+        v.assign((const T *) p, (const T *) p + count);
+    }
+
+private:
+    void readHeader(int64 & a, int & b, int & c);
+    const char * readBytes(const int64 length); //Also skips the padding
+
+    const char * data;
+    size_t size;
+    size_t offset;
+    bool ok;
+    bool mapped;
+    vector<char> buffer; //Used instead of a mapping where mmap is not available
+};
+
+} /* namespace cmt */
+
+#endif /* end of include guard: SNAPSHOT_H */
@@ -0,0 +1,148 @@
+#include "CMT.h"
+#include "Snapshot.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+using cmt::CMT;
+using cmt::SnapshotReader;
+using cmt::SnapshotWriter;
+using std::cout;
+using std::endl;
+
+static const char * PATH = "snapshot_test.bin";
+
+//Writes a snapshot in the layout of CMT::saveSnapshot() with num_fg_matcher foreground points in the matcher
+//records and num_fg_consensus points in the consensus records, class_shift is added to the last class
+static void writeSnapshot(const string & detector, const string & descriptor, int num_fg_matcher, int num_fg_consensus,
+        int class_shift = 0)
+{
+    SnapshotWriter writer;
+    writer.open(PATH);
+
+    writer.writeString(detector);
+    writer.writeString(descriptor);
+
+    vector<float> size(2, 20);
+    writer.writeVector(size);
+
+    //Matcher: one background descriptor followed by the foreground descriptors
+    vector<Point2f> points_matcher;
+    vector<int> classes(1, -1);
+    for (int i = 0; i < num_fg_matcher; i++)
+    {
+        points_matcher.push_back(Point2f(i, -i));
+        classes.push_back(i);
+    }
+    classes.back() += class_shift;
+
+    Mat database(num_fg_matcher + 1, 64, CV_8U);
+    for (int i = 0; i < database.rows; i++)
+    {
+        for (int j = 0; j < database.cols; j++)
+        {
+            database.at<uchar>(i, j) = (uchar) (i * 31 + j * 7);
+        }
+    }
+
+    vector<int> sizes;
+    sizes.push_back(database.cols * 8);
+    sizes.push_back(1);
+
+    writer.writeVector(points_matcher);
+    writer.writeMat(database);
+    writer.writeVector(classes);
+    writer.writeVector(sizes);
+
+    //Consensus
+    vector<Point2f> points_consensus;
+    for (int i = 0; i < num_fg_consensus; i++)
+    {
+        points_consensus.push_back(Point2f(i, -i));
+    }
+
+    Mat pairwise = Mat::zeros(num_fg_consensus, num_fg_consensus, CV_32F);
+
+    writer.writeVector(points_consensus);
+    writer.writeMat(pairwise);
+    writer.writeMat(pairwise);
+
+    writer.close();
+}
+
+static bool load()
+{
+    CMT cmt;
+    Mat im = Mat::zeros(100, 100, CV_8UC1);
+    return cmt.initializeFromSnapshot(im, Rect(40, 40, 20, 20), PATH);
+}
+
+//Overwrites the first 8 byte value equal to from in the file with to, returns false if there is none
+static bool patchFile(long long from, long long to)
+{
+    FILE * file = fopen(PATH, "r+b");
+    if (file == NULL) return false;
+
+    char buffer[4096];
+    size_t length = fread(buffer, 1, sizeof(buffer), file);
+
+    for (size_t i = 0; i + sizeof(long long) <= length; i += 8)
+    {
+        long long value;
+        memcpy(&value, buffer + i, sizeof(value));
+        if (value != from) continue;
+
+        fseek(file, i, SEEK_SET);
+        fwrite(&to, sizeof(to), 1, file);
+        fclose(file);
+        return true;
+    }
+
+    fclose(file);
+    return false;
+}
+
+static int failures = 0;
+
+static void check(bool condition, const char * description)
+{
+    cout << (condition ? "pass: " : "FAIL: ") << description << endl;
+    if (!condition) failures++;
+}
+
+int main()
+{
+    FILELog::ReportingLevel() = logERROR;
+    Output2FILE::Stream() = stderr;
+
+    writeSnapshot("FAST", "BRISK", 3, 3);
+    check(load(), "consistent snapshot loads");
+
+    writeSnapshot("FAST", "BRISK", 3, 2);
+    check(!load(), "consensus with fewer points than the matcher is rejected");
+
+    writeSnapshot("FAST", "BRISK", 2, 3);
+    check(!load(), "consensus with more points than the matcher is rejected");
+
+    writeSnapshot("FAST", "BRISK", 3, 3, 1);
+    check(!load(), "class beyond the foreground points is rejected");
+
+    writeSnapshot("NO_SUCH_DETECTOR", "BRISK", 3, 3);
+    check(!load(), "unknown detector is rejected");
+
+    writeSnapshot("FAST", "NO_SUCH_DESCRIPTOR", 3, 3);
+    check(!load(), "unknown descriptor is rejected");
+
+    //The detector name is the first record, its element count is 4
+    writeSnapshot("FAST", "BRISK", 3, 3);
+    check(patchFile(4, (1LL << 61) + 1) && !load(), "overflowing element count is rejected");
+
+    //The database has 7 rows, no record before it has 7 elements
+    writeSnapshot("FAST", "BRISK", 6, 6);
+    check(patchFile(7, (1LL << 62) / 64) && !load(), "overflowing matrix size is rejected");
+
+    remove(PATH);
+
+    return failures == 0 ? 0 : 1;
+}
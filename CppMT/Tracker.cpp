@@ -2,9 +2,21 @@
 
 #include "Tracker.h"
 
+using cv::TermCriteria;
+
 namespace cmt {
 
-void Tracker::track(const Mat im_prev, const Mat im_gray, const vector<Point2f> & points_prev,
+//Builds the pyramid of im once, so that it can be used for both flow directions and in the next frame
+void Tracker::buildPyramid(const Mat im, vector<Mat> & pyramid)
+{
+    FILE_LOG(logDEBUG) << "Tracker::buildPyramid() call";
+
+    buildOpticalFlowPyramid(im, pyramid, win_size, max_level);
+
+    FILE_LOG(logDEBUG) << "Tracker::buildPyramid() return";
+}
+
+void Tracker::track(const vector<Mat> & pyr_prev, const vector<Mat> & pyr_gray, const vector<Point2f> & points_prev,
         vector<Point2f> & points_tracked, vector<unsigned char> & status)
 {
     FILE_LOG(logDEBUG) << "Tracker::track() call";
@@ -13,15 +25,21 @@ void Tracker::track(const Mat im_prev, const Mat im_gray, const vector<Point2f>
     {
         vector<float> err; //Needs to be float
 
+        //The pyramids have been built with win_size and max_level, so the same values have to be used here.
+        //Should the pyramids have fewer levels, calcOpticalFlowPyrLK uses only the available ones.
+        TermCriteria criteria(TermCriteria::COUNT+TermCriteria::EPS, 30, 0.01);
+
         //Calculate forward optical flow for prev_location
-        calcOpticalFlowPyrLK(im_prev, im_gray, points_prev, points_tracked, status, err);
+        calcOpticalFlowPyrLK(pyr_prev, pyr_gray, points_prev, points_tracked, status, err,
+                win_size, max_level, criteria);
 
         vector<Point2f> points_back;
         vector<unsigned char> status_back;
         vector<float> err_back; //Needs to be float
 
         //Calculate backward optical flow for prev_location
-        calcOpticalFlowPyrLK(im_gray, im_prev, points_tracked, points_back, status_back, err_back);
+        calcOpticalFlowPyrLK(pyr_gray, pyr_prev, points_tracked, points_back, status_back, err_back,
+                win_size, max_level, criteria);
 
         //Traverse vector backward so we can remove points on the fly
         for (int i = points_prev.size()-1; i >= 0; i--)
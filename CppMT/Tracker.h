@@ -4,17 +4,22 @@
 
 #include "common.h"
 
+using cv::Size;
+
 namespace cmt {
 
 class Tracker
 {
 public:
-    Tracker() : thr_fb(30) {};
-    void track(const Mat im_prev, const Mat im_gray, const vector<Point2f> & points_prev,
+    Tracker() : thr_fb(30), win_size(21,21), max_level(3) {};
+    void buildPyramid(const Mat im, vector<Mat> & pyramid);
+    void track(const vector<Mat> & pyr_prev, const vector<Mat> & pyr_gray, const vector<Point2f> & points_prev,
             vector<Point2f> & points_tracked, vector<unsigned char> & status);
 
 private:
     float thr_fb;
+    Size win_size;
+    int max_level;
 };
 
 } /* namespace CMT */
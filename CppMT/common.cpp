@@ -1,5 +1,15 @@
 #include "common.h"
 
+#include <cstring>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
 using std::nth_element;
 
 namespace cmt {
@@ -28,4 +38,67 @@ Point2f rotate(const Point2f v, const float angle)
     return r;
 }
 
+static inline int popcount64(uint64 x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    return (int) __popcnt64(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+//Number of differing bits between two binary descriptors of length bytes
+int hammingDistance(const uchar * a, const uchar * b, const int length)
+{
+    int distance = 0;
+    int i = 0;
+
+#ifdef __AVX2__
+    //Count bits per nibble with a lookup table, then sum up the bytes
+    const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                            0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i mask_low = _mm256_set1_epi8(0x0f);
+    __m256i sum = _mm256_setzero_si256();
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (a + i)),
+                _mm256_loadu_si256((const __m256i *) (b + i)));
+        __m256i low = _mm256_and_si256(v, mask_low);
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask_low);
+        __m256i count = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, low), _mm256_shuffle_epi8(lookup, high));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(count, _mm256_setzero_si256()));
+    }
+
+    distance += _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1)
+        + _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+#endif
+
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64 x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        distance += popcount64(x ^ y);
+    }
+
+    for (; i < length; i++)
+    {
+        distance += popcount64(a[i] ^ b[i]);
+    }
+
+    return distance;
+}
+
+//Packs the coordinates of a grid cell into a single sortable key
+int64 gridCellKey(const int cx, const int cy)
+{
+    return (int64) (((uint64) (unsigned int) cx << 32) | (unsigned int) cy);
+}
+
 } /* namespace cmt */
@@ -21,6 +21,8 @@ namespace cmt
 {
     float median(vector<float> & A);
     Point2f rotate(const Point2f v, const float angle);
+    int hammingDistance(const uchar * a, const uchar * b, const int length);
+    int64 gridCellKey(const int cx, const int cy);
     template<class T>
     int sgn(T x)
     {
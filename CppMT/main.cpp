@@ -1,12 +1,17 @@
 #include "CMT.h"
+#include "FrameReader.h"
+#include "MultiCMT.h"
 #include "gui.h"
 
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <climits>
 #include <cstdio>
+#include <cstdlib>
 
 #ifdef __GNUC__
 #include <getopt.h>
@@ -15,6 +20,8 @@
 #endif
 
 using cmt::CMT;
+using cmt::FrameReader;
+using cmt::MultiCMT;
 using cv::imread;
 using cv::namedWindow;
 using cv::Scalar;
@@ -30,6 +37,8 @@ using std::min_element;
 using std::max_element;
 using std::endl;
 using ::atof;
+using ::atoi;
+using ::strtol;
 
 static string WIN_NAME = "CMT";
 
@@ -48,13 +57,24 @@ vector<float> getNextLineAndSplitIntoFloats(istream& str)
     return result;
 }
 
-int display(Mat im, CMT & cmt)
+//Lets CMT (or MultiCMT) process the current frame.
+//This happens on the calling thread, so that parallel_for_ calls inside processFrame() are not nested.
+template<class T>
+void processFrame(T & cmt, const Mat & im)
+{
+    Mat im_gray;
+    cvtColor(im, im_gray, CV_BGR2GRAY);
+    cmt.processFrame(im_gray);
+}
+
+void draw(Mat im, CMT & cmt)
 {
     //Visualize the output
     //It is ok to draw on im itself, as CMT only uses the grayscale image
+    //Active points are in working resolution
     for(size_t i = 0; i < cmt.points_active.size(); i++)
     {
-        circle(im, cmt.points_active[i], 2, Scalar(255,0,0));
+        circle(im, cmt.points_active[i] * (1 / cmt.working_scale), 2, Scalar(255,0,0));
     }
 
     Point2f vertices[4];
@@ -63,12 +83,243 @@ int display(Mat im, CMT & cmt)
     {
         line(im, vertices[i], vertices[(i+1)%4], Scalar(255,0,0));
     }
+}
+
+int display(Mat im, CMT & cmt)
+{
+    draw(im, cmt);
+
+    imshow(WIN_NAME, im);
+
+    return waitKey(5);
+}
+
+int display(Mat im, MultiCMT & multi_cmt)
+{
+    for (size_t i = 0; i < multi_cmt.targets.size(); i++)
+    {
+        draw(im, multi_cmt.targets[i]);
+    }
 
     imshow(WIN_NAME, im);
 
     return waitKey(5);
 }
 
+void logFrame(int frame, CMT & cmt)
+{
+    //TODO: Provide meaningful output
+    FILE_LOG(logINFO) << "#" << frame << " active: " << cmt.points_active.size()
+        << " detections roi/full: " << cmt.num_frames_roi << "/" << cmt.num_frames_full
+        << " (" << cmt.num_frames_collapse << " after losing inliers)";
+}
+
+void logFrame(int frame, MultiCMT & multi_cmt)
+{
+    for (size_t i = 0; i < multi_cmt.targets.size(); i++)
+    {
+        Rect rect = multi_cmt.targets[i].bb_rot.boundingRect();
+        FILE_LOG(logINFO) << "#" << frame << " target " << i << " active: " << multi_cmt.targets[i].points_active.size()
+            << " bbox: " << rect.x << "," << rect.y << "," << rect.width << "," << rect.height;
+    }
+}
+
+//Times Fusion::preferFirst() against the original implementation on random point sets of typical sizes,
+//the classes of the first set are unique like those of tracked points, the second set may repeat classes
+int benchmarkFusion()
+{
+    cv::RNG rng(1);
+    int sizes[] = {100, 500, 2000};
+
+    for (int s = 0; s < 3; s++)
+    {
+        int num_classes = sizes[s];
+
+        vector<int> classes_first;
+        for (int c = 0; c < num_classes; c++)
+        {
+            if (rng.uniform(0, 2)) classes_first.push_back(c);
+        }
+
+        vector<int> classes_second;
+        for (int c = 0; c < num_classes; c++)
+        {
+            classes_second.push_back(rng.uniform(0, num_classes));
+        }
+
+        vector<Point2f> points_first(classes_first.size());
+        vector<Point2f> points_second(classes_second.size());
+
+        cmt::Fusion fusion;
+        fusion.initialize(num_classes);
+
+        //Enough repetitions for the quadratic reference to take a measurable time
+        int repetitions = std::max(1, 20000000 / (num_classes * num_classes));
+
+        vector<Point2f> points_reference, points_fused;
+        vector<int> classes_reference, classes_fused;
+
+        int64 tic = cv::getTickCount();
+        for (int r = 0; r < repetitions; r++)
+        {
+            fusion.preferFirstReference(points_first, classes_first, points_second, classes_second,
+                    points_reference, classes_reference);
+        }
+        double ms_reference = (cv::getTickCount() - tic) * 1000. / cv::getTickFrequency() / repetitions;
+
+        tic = cv::getTickCount();
+        for (int r = 0; r < repetitions; r++)
+        {
+            fusion.preferFirst(points_first, classes_first, points_second, classes_second, points_fused, classes_fused);
+        }
+        double ms_fused = (cv::getTickCount() - tic) * 1000. / cv::getTickFrequency() / repetitions;
+
+        cout << num_classes << " classes: reference " << ms_reference << " ms, class flags " << ms_fused << " ms"
+            << (classes_fused == classes_reference ? "" : ", results differ!") << endl;
+    }
+
+    return 0;
+}
+
+//Tracks frames that are already decoded and converted, returns the time it took in seconds
+double trackFrames(CMT & cmt, const vector<Mat> & frames_gray, const Rect rect, vector<Rect> & boxes)
+{
+    cmt.initialize(frames_gray[0], rect);
+
+    int64 tic = cv::getTickCount();
+
+    for (size_t i = 1; i < frames_gray.size(); i++)
+    {
+        cmt.processFrame(frames_gray[i]);
+        boxes.push_back(cmt.bb_rot.boundingRect());
+    }
+
+    return (cv::getTickCount() - tic) / cv::getTickFrequency();
+}
+
+//Mean intersection over union of two sequences of bounding boxes
+double meanOverlap(const vector<Rect> & boxes1, const vector<Rect> & boxes2)
+{
+    double overlap = 0;
+    for (size_t i = 0; i < boxes1.size(); i++)
+    {
+        double area_union = boxes1[i].area() + boxes2[i].area() - (boxes1[i] & boxes2[i]).area();
+        if (area_union > 0) overlap += (boxes1[i] & boxes2[i]).area() / area_union;
+    }
+
+    return boxes1.empty() ? 0 : overlap / boxes1.size();
+}
+
+//Tracks the video at input_path with the configuration of cmt, once at full and once at working resolution.
+//All frames are decoded up front, so that only the tracker is timed.
+//The overlap tells how much the lower resolution changes the result.
+int benchmarkResolution(const CMT & cmt, const string & input_path, const Rect rect)
+{
+    VideoCapture cap;
+    cap.open(input_path);
+
+    vector<Mat> frames_gray;
+    while (true)
+    {
+        Mat im;
+        cap >> im;
+        if (im.empty()) break;
+
+        Mat im_gray;
+        cvtColor(im, im_gray, CV_BGR2GRAY);
+        frames_gray.push_back(im_gray);
+    }
+
+    if (frames_gray.size() < 2)
+    {
+        cerr << "Unable to read at least two frames from " << input_path << "." << endl;
+        return 1;
+    }
+
+    size_t num_frames = frames_gray.size() - 1;
+
+    CMT cmt_full = cmt;
+    cmt_full.auto_resolution = false;
+    vector<Rect> boxes_full;
+    double seconds_full = trackFrames(cmt_full, frames_gray, rect, boxes_full);
+
+    CMT cmt_working = cmt;
+    cmt_working.auto_resolution = true;
+    vector<Rect> boxes_working;
+    double seconds_working = trackFrames(cmt_working, frames_gray, rect, boxes_working);
+
+    cout << "full resolution: " << num_frames / seconds_full << " fps" << endl;
+    cout << "working resolution (size " << cmt_working.working_size << ", scale " << cmt_working.working_scale
+        << "): " << num_frames / seconds_working << " fps" << endl;
+    cout << "mean overlap: " << meanOverlap(boxes_full, boxes_working) << endl;
+
+    return 0;
+}
+
+//Initializes CMT from the image or from a model snapshot, then saves the model if requested
+bool initialize(CMT & cmt, const Mat im_gray, const Rect rect, const string & load_model_path,
+        const string & save_model_path)
+{
+    if (load_model_path.empty())
+    {
+        cmt.initialize(im_gray, rect);
+    }
+
+    else if (!cmt.initializeFromSnapshot(im_gray, rect, load_model_path))
+    {
+        cerr << "Unable to load model " << load_model_path << endl;
+        return false;
+    }
+
+    if (!save_model_path.empty() && !cmt.saveSnapshot(save_model_path))
+    {
+        cerr << "Unable to save model " << save_model_path << endl;
+        return false;
+    }
+
+    return true;
+}
+
+//Main loop of normal mode, for both CMT and MultiCMT
+template<class T>
+int run(T & cmt, VideoCapture & cap, const Mat im0, bool loop_flag)
+{
+    int frame = 0;
+    FrameReader reader;
+
+    //Read the first image to process
+    Mat im_next;
+    if (loop_flag) im0.copyTo(im_next);
+    else cap >> im_next;
+
+    while (true)
+    {
+        frame++;
+
+        Mat im = im_next;
+        im_next = Mat();
+
+        //Stop at the end of the stream
+        if (im.empty()) break;
+
+        //Let CMT process the frame while the next image is read from the stream
+        reader.start(loop_flag ? NULL : &cap, "");
+        processFrame(cmt, im);
+        im_next = reader.wait();
+
+        //If loop flag is set, reuse initial image (for debugging purposes)
+        if (loop_flag) im0.copyTo(im_next);
+
+        char key = display(im, cmt);
+
+        if(key == 'q') break;
+
+        logFrame(frame, cmt);
+    }
+
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     //Create a CMT object
@@ -77,18 +328,40 @@ int main(int argc, char **argv)
     //Initialization bounding box
     Rect rect;
 
+    //Initialization bounding boxes, if more than one is given, MultiCMT is used
+    vector<Rect> rects;
+
     //Parse args
     int challenge_flag = 0;
     int loop_flag = 0;
     int verbose_flag = 0;
     int bbox_flag = 0;
+    int benchmark_resolution_flag = 0;
     string input_path;
+    string save_model_path;
+    string load_model_path;
+
+    //Last given option that only applies to a single target, MultiCMT detects in the whole image at full resolution
+    string single_target_option;
 
     const int detector_cmd = 1000;
     const int descriptor_cmd = 1001;
     const int bbox_cmd = 1002;
     const int no_scale_cmd = 1003;
     const int with_rotation_cmd = 1004;
+    const int exact_scale_rotation_cmd = 1005;
+    const int grid_consensus_cmd = 1006;
+    const int threads_cmd = 1007;
+    const int hamming_index_cmd = 1008;
+    const int index_recall_cmd = 1009;
+    const int full_frame_detection_cmd = 1010;
+    const int full_frame_interval_cmd = 1011;
+    const int save_model_cmd = 1012;
+    const int load_model_cmd = 1013;
+    const int auto_resolution_cmd = 1014;
+    const int working_size_cmd = 1015;
+    const int index_radius_cmd = 1016;
+    const int benchmark_fusion_cmd = 1017;
 
     struct option longopts[] =
     {
@@ -96,12 +369,26 @@ int main(int argc, char **argv)
         {"challenge", no_argument, &challenge_flag, 1},
         {"loop", no_argument, &loop_flag, 1},
         {"verbose", no_argument, &verbose_flag, 1},
+        {"benchmark-resolution", no_argument, &benchmark_resolution_flag, 1},
         //Argument options
         {"bbox", required_argument, 0, bbox_cmd},
         {"detector", required_argument, 0, detector_cmd},
         {"descriptor", required_argument, 0, descriptor_cmd},
         {"no-scale", no_argument, 0, no_scale_cmd},
         {"with-rotation", no_argument, 0, with_rotation_cmd},
+        {"exact-scale-rotation", no_argument, 0, exact_scale_rotation_cmd},
+        {"grid-consensus", no_argument, 0, grid_consensus_cmd},
+        {"threads", required_argument, 0, threads_cmd},
+        {"hamming-index", no_argument, 0, hamming_index_cmd},
+        {"index-recall", no_argument, 0, index_recall_cmd},
+        {"index-radius", required_argument, 0, index_radius_cmd},
+        {"benchmark-fusion", no_argument, 0, benchmark_fusion_cmd},
+        {"full-frame-detection", no_argument, 0, full_frame_detection_cmd},
+        {"full-frame-interval", required_argument, 0, full_frame_interval_cmd},
+        {"save-model", required_argument, 0, save_model_cmd},
+        {"load-model", required_argument, 0, load_model_cmd},
+        {"auto-resolution", no_argument, 0, auto_resolution_cmd},
+        {"working-size", required_argument, 0, working_size_cmd},
         {0, 0, 0, 0}
     };
 
@@ -128,6 +415,7 @@ int main(int argc, char **argv)
 
                     bbox_flag = 1;
                     rect = Rect(x,y,w,h);
+                    rects.push_back(rect);
                 }
                 break;
             case detector_cmd:
@@ -142,6 +430,66 @@ int main(int argc, char **argv)
             case with_rotation_cmd:
                 cmt.consensus.estimate_rotation = true;
                 break;
+            case exact_scale_rotation_cmd:
+                cmt.consensus.exact_scale_rotation = true;
+                break;
+            case grid_consensus_cmd:
+                cmt.consensus.cluster_grid = true;
+                break;
+            case threads_cmd:
+                {
+                    char * end;
+                    long num_threads = strtol(optarg, &end, 10);
+                    if (end == optarg || *end != '\0' || num_threads < 0 || num_threads > INT_MAX)
+                    {
+                        cerr << "number of threads must be a non-negative integer" << endl;
+                        return 1;
+                    }
+
+                    cv::setNumThreads(num_threads);
+                }
+                break;
+            case hamming_index_cmd:
+                cmt.matcher.use_index = true;
+                break;
+            case index_recall_cmd:
+                cmt.matcher.use_index = true;
+                cmt.matcher.check_recall = true;
+                break;
+            case index_radius_cmd:
+                cmt.matcher.use_index = true;
+                cmt.matcher.index_radius = atoi(optarg);
+                if (cmt.matcher.index_radius < 0)
+                {
+                    cerr << "index radius must not be negative" << endl;
+                    return 1;
+                }
+                break;
+            case benchmark_fusion_cmd:
+                return benchmarkFusion();
+            case full_frame_detection_cmd:
+                cmt.detect_roi = false;
+                single_target_option = "--full-frame-detection";
+                break;
+            case full_frame_interval_cmd:
+                cmt.full_frame_interval = atoi(optarg);
+                single_target_option = "--full-frame-interval";
+                break;
+            case save_model_cmd:
+                save_model_path = optarg;
+                break;
+            case load_model_cmd:
+                load_model_path = optarg;
+                break;
+            case auto_resolution_cmd:
+                cmt.auto_resolution = true;
+                single_target_option = "--auto-resolution";
+                break;
+            case working_size_cmd:
+                cmt.auto_resolution = true;
+                cmt.working_size = atof(optarg);
+                single_target_option = "--working-size";
+                break;
             case '?':
                 return 1;
         }
@@ -164,6 +512,36 @@ int main(int argc, char **argv)
     FILELog::ReportingLevel() = verbose_flag ? logDEBUG : logINFO;
     Output2FILE::Stream() = stdout; //Log to stdout
 
+    if (challenge_flag && rects.size() > 1)
+    {
+        cerr << "Only one bounding box is allowed in challenge mode." << endl;
+        return 1;
+    }
+
+    if (rects.size() > 1 && (!load_model_path.empty() || !save_model_path.empty()))
+    {
+        cerr << "Models can not be saved or loaded with more than one bounding box." << endl;
+        return 1;
+    }
+
+    if (rects.size() > 1 && !single_target_option.empty())
+    {
+        cerr << single_target_option << " can not be used with more than one bounding box." << endl;
+        return 1;
+    }
+
+    //Resolution benchmark, on a video with one bounding box
+    if (benchmark_resolution_flag)
+    {
+        if (input_path.empty() || rects.size() != 1)
+        {
+            cerr << "The resolution benchmark needs an input video and one bounding box." << endl;
+            return 1;
+        }
+
+        return benchmarkResolution(cmt, input_path, rect);
+    }
+
     //Challenge mode
     if (challenge_flag)
     {
@@ -216,20 +594,26 @@ int main(int argc, char **argv)
         cvtColor(im0, im0_gray, CV_BGR2GRAY);
 
         //Initialize cmt
-        cmt.initialize(im0_gray, rect);
+        if (!initialize(cmt, im0_gray, rect, load_model_path, save_model_path)) return 1;
 
         //Write init region to output file
         ofstream output_file("output.txt");
         output_file << rect.x << ',' << rect.y << ',' << rect.width << ',' << rect.height << std::endl;
 
-        //Process images, write output to file
+        //Read the first image to process
+        FrameReader reader;
+        Mat im_next;
+        if (files.size() > 1) im_next = imread(files[1]);
+
+        //Process images, write output to file. The next image is read while the current one is processed.
         for (size_t i = 1; i < files.size(); i++)
         {
             FILE_LOG(logINFO) << "Processing frame " << i << "/" << files.size();
-            Mat im = imread(files[i]);
-            Mat im_gray;
-            cvtColor(im, im_gray, CV_BGR2GRAY);
-            cmt.processFrame(im_gray);
+            Mat im = im_next;
+            im_next = Mat();
+            reader.start(NULL, i + 1 < files.size() ? files[i+1] : "");
+            processFrame(cmt, im);
+            im_next = reader.wait();
             if (verbose_flag)
             {
                 display(im, cmt);
@@ -297,42 +681,34 @@ int main(int argc, char **argv)
         rect = getRect(im0, WIN_NAME);
     }
 
-    FILE_LOG(logINFO) << "Using " << rect.x << "," << rect.y << "," << rect.width << "," << rect.height
-        << " as initial bounding box.";
-
     //Convert im0 to grayscale
     Mat im0_gray;
     cvtColor(im0, im0_gray, CV_BGR2GRAY);
 
-    //Initialize CMT
-    cmt.initialize(im0_gray, rect);
-
-    int frame = 0;
-
-    //Main loop
-    while (true)
+    //Multi-target mode, every target gets the configuration given on the command line
+    if (rects.size() > 1)
     {
-        frame++;
-
-        Mat im;
+        MultiCMT multi_cmt;
+        multi_cmt.str_detector = cmt.str_detector;
+        multi_cmt.str_descriptor = cmt.str_descriptor;
+        multi_cmt.targets.assign(rects.size(), cmt);
 
-        //If loop flag is set, reuse initial image (for debugging purposes)
-        if (loop_flag) im0.copyTo(im);
-        else cap >> im; //Else use next image in stream
-
-        Mat im_gray;
-        cvtColor(im, im_gray, CV_BGR2GRAY);
+        for (size_t i = 0; i < rects.size(); i++)
+        {
+            FILE_LOG(logINFO) << "Using " << rects[i].x << "," << rects[i].y << "," << rects[i].width << ","
+                << rects[i].height << " as initial bounding box of target " << i << ".";
+        }
 
-        //Let CMT process the frame
-        cmt.processFrame(im_gray);
+        multi_cmt.initialize(im0_gray, rects);
 
-        char key = display(im, cmt);
+        return run(multi_cmt, cap, im0, loop_flag);
+    }
 
-        if(key == 'q') break;
+    FILE_LOG(logINFO) << "Using " << rect.x << "," << rect.y << "," << rect.width << "," << rect.height
+        << " as initial bounding box.";
 
-        //TODO: Provide meaningful output
-        FILE_LOG(logINFO) << "#" << frame << " active: " << cmt.points_active.size();
-    }
+    //Initialize CMT
+    if (!initialize(cmt, im0_gray, rect, load_model_path, save_model_path)) return 1;
 
-    return 0;
+    return run(cmt, cap, im0, loop_flag);
 }
@@ -5,34 +5,345 @@
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
-#include <iostream>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <iostream>
 
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using std::cerr;
 using std::cout;
 using std::endl;
-using std::ofstream;
+using std::ifstream;
 
 using cmt::CMT;
 using cv::cvtColor;
+using cv::getTickCount;
+using cv::getTickFrequency;
+using cv::imdecode;
 using cv::imread;
+using std::string;
+
+//Color frames are converted alternately into these two buffers.
+//Their memory is reused across frames, while CMT can still hold on to the previous frame.
+static Mat buffers_gray[2];
+static int buffer_current = 0;
 
-int main()
+//Returns the buffer for the next converted frame
+static Mat & nextBuffer()
 {
+    Mat & im_gray = buffers_gray[buffer_current];
+    buffer_current = 1 - buffer_current;
 
+    return im_gray;
+}
 
-    trax_handle* trax;
-    trax_configuration config;
-    config.format_region = TRAX_REGION_RECTANGLE;
-    config.format_image = TRAX_IMAGE_PATH;
+//Returns the grayscale version of a decoded frame. Grayscale frames are used as they are, without copying.
+static Mat toGray(const Mat im, const int code)
+{
+    if (im.channels() == 1) return im;
 
-    // Call trax_server_setup to initialize trax protocol
-    trax = trax_server_setup_standard(config, NULL);
+    Mat & im_gray = nextBuffer();
+    cvtColor(im, im_gray, code);
+
+    return im_gray;
+}
+
+//Returns a trax image as grayscale Mat, which is empty if the image can not be read.
+//GRAY8 memory images are wrapped without copying, so the trax image must outlive the returned Mat.
+static Mat getImageGray(trax_image* img)
+{
+    int type = trax_image_get_type(img);
+
+    if (type == TRAX_IMAGE_MEMORY)
+    {
+        int width, height, format;
+        trax_image_get_memory_header(img, &width, &height, &format);
+
+        char* row = trax_image_get_memory_row(img, 0);
+        size_t step = height > 1 ? trax_image_get_memory_row(img, 1) - row : Mat::AUTO_STEP;
+
+        if (format == TRAX_IMAGE_MEMORY_GRAY8)
+        {
+            return Mat(height, width, CV_8UC1, row, step);
+        }
+
+        if (format == TRAX_IMAGE_MEMORY_RGB)
+        {
+            return toGray(Mat(height, width, CV_8UC3, row, step), CV_RGB2GRAY);
+        }
+
+        //16 bit frames are scaled down to 8 bit
+        if (format == TRAX_IMAGE_MEMORY_GRAY16)
+        {
+            Mat & im_gray = nextBuffer();
+            Mat(height, width, CV_16UC1, row, step).convertTo(im_gray, CV_8U, 1 / 256.);
+            return im_gray;
+        }
+
+        FILE_LOG(logERROR) << "Unsupported memory image format " << format;
+        return Mat();
+    }
+
+    //Encoded image in memory, at least there is no disk access
+    if (type == TRAX_IMAGE_BUFFER)
+    {
+        int length, format;
+        const char* data = trax_image_get_buffer(img, &length, &format);
+
+        return imdecode(Mat(1, length, CV_8UC1, (void*) data), CV_LOAD_IMAGE_GRAYSCALE);
+    }
+
+    //In path mode images are read from the disk. The master program tells the
+    //tracker where to get them.
+    return imread(trax_image_get_path(img), CV_LOAD_IMAGE_GRAYSCALE);
+}
+
+#ifndef _WIN32
+//Starts the given executable as trax server on the other end of two pipes, returns the client handle
+static trax_handle* startServer(const char* executable, pid_t & pid)
+{
+    int to_server[2];
+    int from_server[2];
+    if (pipe(to_server) != 0) return NULL;
+    if (pipe(from_server) != 0)
+    {
+        close(to_server[0]);
+        close(to_server[1]);
+        return NULL;
+    }
+
+    pid = fork();
+
+    if (pid == 0)
+    {
+        //The server speaks trax on its standard streams
+        dup2(to_server[0], STDIN_FILENO);
+        dup2(from_server[1], STDOUT_FILENO);
+        close(to_server[0]);
+        close(to_server[1]);
+        close(from_server[0]);
+        close(from_server[1]);
+        execlp(executable, executable, (char*) NULL);
+        _exit(1);
+    }
+
+    close(to_server[0]);
+    close(from_server[1]);
+
+    if (pid < 0)
+    {
+        close(to_server[1]);
+        close(from_server[0]);
+        return NULL;
+    }
+
+    return trax_client_setup_file(from_server[0], to_server[1], trax_no_log);
+}
+
+//Waits for the region the server reports for the last image, returns false if it does not answer
+static bool waitRegion(trax_handle* client, Rect & box)
+{
+    trax_region* region = NULL;
+    trax_properties* prop = trax_properties_create();
+
+    bool ok = trax_client_wait(client, &region, prop) == TRAX_STATE && region != NULL;
+
+    if (ok)
+    {
+        float x, y, width, height;
+        trax_region_get_rectangle(region, &x, &y, &width, &height);
+        box = Rect(x, y, width, height);
+    }
+
+    if (region != NULL) trax_region_release(&region);
+    trax_properties_release(&prop);
+
+    return ok;
+}
+
+//Tracks the images through the trax protocol, with this executable as server in a separate process.
+//Returns the time it took in seconds, without initialization, or a negative value if the server failed.
+static double trackTrax(const char* executable, const vector<trax_image*> & images, const Rect rect, vector<Rect> & boxes)
+{
+    pid_t pid;
+    trax_handle* client = startServer(executable, pid);
+    if (client == NULL) return -1;
+
+    trax_region* region = trax_region_create_rectangle(rect.x, rect.y, rect.width, rect.height);
+    trax_client_initialize(client, images[0], region, NULL);
+    trax_region_release(&region);
 
-    ofstream ofile("/home/georg/traxlog");
+    Rect box;
+    bool ok = waitRegion(client, box);
+
+    int64 tic = getTickCount();
+
+    for (size_t i = 1; ok && i < images.size(); i++)
+    {
+        trax_client_frame(client, images[i], NULL);
+        ok = waitRegion(client, box);
+        boxes.push_back(box);
+    }
+
+    double seconds = (getTickCount() - tic) / getTickFrequency();
+
+    //Cleaning up tells the server to quit
+    trax_cleanup(&client);
+    waitpid(pid, NULL, 0);
+
+    return ok ? seconds : -1;
+}
+#endif
+
+//Tracks frames that are already in memory, returns the time it took in seconds
+static double track(CMT & cmt, const vector<Mat> & frames, const Rect rect, vector<Rect> & boxes)
+{
+    cmt.initialize(toGray(frames[0], CV_BGR2GRAY), rect);
+
+    int64 tic = getTickCount();
+
+    for (size_t i = 1; i < frames.size(); i++)
+    {
+        cmt.processFrame(toGray(frames[i], CV_BGR2GRAY));
+        boxes.push_back(cmt.bb_rot.boundingRect());
+    }
+
+    return (getTickCount() - tic) / getTickFrequency();
+}
+
+//Mean intersection over union of two sequences of bounding boxes
+static double meanOverlap(const vector<Rect> & boxes1, const vector<Rect> & boxes2)
+{
+    double overlap = 0;
+    for (size_t i = 0; i < boxes1.size(); i++)
+    {
+        double area_union = boxes1[i].area() + boxes2[i].area() - (boxes1[i] & boxes2[i]).area();
+        if (area_union > 0) overlap += (boxes1[i] & boxes2[i]).area() / area_union;
+    }
+
+    return boxes1.empty() ? 0 : overlap / boxes1.size();
+}
+
+//Local stand-in for the evaluation harness, for the frames listed in images.txt.
+//First, CMT tracks the decoded frames in this process, at full and at automatically chosen resolution.
+//This is the frames per second of the tracker alone, the overlap tells how much the lower resolution changes the result.
+//Then this executable is started as trax server and the sequence is sent to it once as paths and once as memory images.
+//This is the frames per second end to end, including the protocol and reading the images in the server.
+static int benchmark(const char* executable)
+{
+    ifstream im_file("images.txt");
+    vector<string> files;
+    vector<Mat> frames;
+    string line;
+    while (getline(im_file, line))
+    {
+        files.push_back(line);
+        frames.push_back(imread(line));
+    }
+
+    float x, y, width, height;
+    FILE* region_file = fopen("region.txt", "r");
+    if (region_file == NULL || fscanf(region_file, "%f,%f,%f,%f", &x, &y, &width, &height) != 4 || frames.size() < 2)
+    {
+        cerr << "Benchmark needs images.txt and region.txt in format x,y,w,h." << endl;
+        if (region_file != NULL) fclose(region_file);
+        return 1;
+    }
+    fclose(region_file);
+
+    Rect rect(x, y, width, height);
+    size_t num_frames = frames.size() - 1;
+
+    CMT cmt_full;
+    vector<Rect> boxes_full;
+    double seconds_full = track(cmt_full, frames, rect, boxes_full);
+
+    CMT cmt_auto;
+    cmt_auto.auto_resolution = true;
+    vector<Rect> boxes_auto;
+    double seconds_auto = track(cmt_auto, frames, rect, boxes_auto);
+
+    cout << "in process, full resolution: " << num_frames / seconds_full << " fps" << endl;
+    cout << "in process, auto resolution (scale " << cmt_auto.working_scale << "): " << num_frames / seconds_auto << " fps" << endl;
+    cout << "mean overlap: " << meanOverlap(boxes_full, boxes_auto) << endl;
+
+#ifdef _WIN32
+    cout << "The trax benchmark is not available on Windows." << endl;
+#else
+    //All images are prepared up front, so that only the protocol and the server are timed
+    vector<trax_image*> images_path;
+    vector<trax_image*> images_memory;
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        images_path.push_back(trax_image_create_path(files[i].c_str()));
+
+        trax_image* img = trax_image_create_memory(frames[i].cols, frames[i].rows, TRAX_IMAGE_MEMORY_RGB);
+        char* row = trax_image_get_memory_row(img, 0);
+        size_t step = frames[i].rows > 1 ? trax_image_get_memory_row(img, 1) - row : Mat::AUTO_STEP;
+        Mat im_rgb(frames[i].rows, frames[i].cols, CV_8UC3, row, step);
+        cvtColor(frames[i], im_rgb, CV_BGR2RGB);
+        images_memory.push_back(img);
+    }
+
+    vector<Rect> boxes_path;
+    double seconds_path = trackTrax(executable, images_path, rect, boxes_path);
+
+    vector<Rect> boxes_memory;
+    double seconds_memory = trackTrax(executable, images_memory, rect, boxes_memory);
+
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        trax_image_release(&images_path[i]);
+        trax_image_release(&images_memory[i]);
+    }
+
+    if (seconds_path < 0 || seconds_memory < 0)
+    {
+        cerr << "The trax server did not answer." << endl;
+        return 1;
+    }
+
+    cout << "trax, path images: " << num_frames / seconds_path << " fps" << endl;
+    cout << "trax, memory images: " << num_frames / seconds_memory << " fps" << endl;
+    cout << "mean overlap of path and memory images: " << meanOverlap(boxes_path, boxes_memory) << endl;
+#endif
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    //Log to stderr, as the trax protocol may use the standard streams
+    FILELog::ReportingLevel() = logINFO;
+    Output2FILE::Stream() = stderr;
+
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+    {
+        return benchmark(argv[0]);
+    }
+
+    //Prefer frames that are already decoded in memory, but also accept encoded buffers and paths
+    trax_metadata* metadata = trax_metadata_create(TRAX_REGION_RECTANGLE,
+            TRAX_IMAGE_MEMORY | TRAX_IMAGE_BUFFER | TRAX_IMAGE_PATH, "CMT", NULL, NULL);
+
+    // Call trax_server_setup to initialize trax protocol
+    trax_handle* trax = trax_server_setup(metadata, trax_no_log);
+    trax_metadata_release(&metadata);
 
     trax_image* img = NULL;
     trax_region* rect = NULL;
 
+    //The image of the previous frame is kept until the current one has been processed,
+    //as memory images are not copied and CMT still refers to the previous frame
+    trax_image* img_prev = NULL;
+
+    //The server persists across sequences, CMT is simply initialized again
     CMT cmt;
 
     while(true)
@@ -43,7 +354,7 @@ int main()
         trax_properties* prop = trax_properties_create();
 
         // The main idea of Trax interface is to leave the control to the master program
-        // and just follow the instructions that the tracker gets. 
+        // and just follow the instructions that the tracker gets.
         // The main function for this is trax_wait that actually listens for commands.
 
         int tr = trax_server_wait(trax, &img, &rect, prop);
@@ -53,7 +364,7 @@ int main()
         // tracker how to initialize.
         if (tr == TRAX_INITIALIZE)
         {
-            ofile << "TRAX_INITIALIZE" << endl;
+            FILE_LOG(logDEBUG) << "TRAX_INITIALIZE";
             float x, y, width, height;
             trax_region_get_rectangle(rect, &x, &y, &width, &height);
 
@@ -62,25 +373,35 @@ int main()
             selection.width = width;
             selection.height = height;
 
-            Mat im = imread(img->data);
-            Mat im_gray;
+            Mat im_gray = getImageGray(img);
+            if (im_gray.empty())
+            {
+                FILE_LOG(logERROR) << "Could not read the initial image";
+                trax_region_release(&rect);
+                trax_properties_release(&prop);
+                break;
+            }
 
-            cvtColor(im, im_gray, CV_BGR2GRAY);
             cmt.initialize(im_gray, selection);
 
             // properties
             trax_server_reply(trax, rect, NULL);
+
+            trax_region_release(&rect);
         }
         // The second one is TRAX_FRAME that tells the tracker what to process next.
         else if (tr == TRAX_FRAME)
         {
-            ofile << "TRAX_FRAME" << endl;
-            // In trax mode images are read from the disk. The master program tells the
-            // tracker where to get them.
-            Mat im = imread(img->data);
-            Mat im_gray;
+            FILE_LOG(logDEBUG) << "TRAX_FRAME";
+
+            Mat im_gray = getImageGray(img);
+            if (im_gray.empty())
+            {
+                FILE_LOG(logERROR) << "Could not read the image of the frame";
+                trax_properties_release(&prop);
+                break;
+            }
 
-            cvtColor(im, im_gray, CV_BGR2GRAY);
             cmt.processFrame(im_gray);
             Rect output = cmt.bb_rot.boundingRect();
 
@@ -105,12 +426,19 @@ int main()
 
         trax_properties_release(&prop);
 
+        //The current image becomes the previous one, the one before can be released now
+        if (img_prev != NULL) trax_image_release(&img_prev);
+        img_prev = img;
+        img = NULL;
+
         }
 
-    // Call trax_cleanup to release potentially allocated resources 
+    if (img_prev != NULL) trax_image_release(&img_prev);
+    if (img != NULL) trax_image_release(&img);
+
+    // Call trax_cleanup to release potentially allocated resources
     trax_cleanup(&trax);
 
     return 0;
 
 }
-
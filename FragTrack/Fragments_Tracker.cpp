@@ -14,40 +14,62 @@ Date:	November 18'th, 2007
 
 #include "Fragments_Tracker.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 //
-// global variable required for the EMD calculation
+// smallest side in pixels the scale search may shrink the template to. Below
+// that the scaled patches are a few pixels each and their histograms are noise
 //
 
-CvMat* bin_bin_distance_matrix;
+static const int MIN_TEMPLATE_SIDE = 8;
+
+//
+// largest relative difference of the float votes to the double reference that
+// --check-votes accepts, per bin. Every bin adds a float rounding error of about
+// 1.2e-7 times the cdf or histogram value it is computed from
+//
+
+static const double VOTE_TOLERANCE_PER_BIN = 1e-6;
 
 //
 // utilities 
 //
 
-void Fragments_Tracker::Draw_Rectangle(int tl_y, int tl_x, int height, int width, CvMat* I)
+void Fragments_Tracker::Draw_Rectangle(int tl_y, int tl_x, int height, int width, cv::Mat& I)
 {
-	CvPoint tl;
+	cv::Point tl;
 	tl.y = tl_y;
 	tl.x = tl_x;
 	
-	CvPoint br;
+	cv::Point br;
 	br.y = tl_y + height - 1;
 	br.x = tl_x + width - 1;
 	
-	cvRectangle(I, tl, br, CV_RGB(255,0,0), 3 );
+	cv::rectangle(I, tl, br, cv::Scalar(0,0,255), 3 );   // red in BGR
 }
 
 //
 // Initializing the tracker object:
 //
 
-Fragments_Tracker::Fragments_Tracker(CvMat* I, Parameters& in_params, ofstream& log_file) : outf(log_file)
+Fragments_Tracker::Fragments_Tracker(cv::Mat& I, Parameters& in_params, ofstream& log_file) : outf(log_file)
 {	
 	//outf << "Initializing tracker ... " << endl << endl;
 	
 	dbg = 0;
 	handled_frame_number = 1;
 
+	vote_stats.frames = 0;
+	vote_stats.vote_time = 0;
+	vote_stats.per_position_time = 0;
+	vote_stats.reference_time = 0;
+	vote_stats.max_difference = 0;
+	vote_stats.max_difference_per_position = 0;
+	vote_stats.tolerance = VOTE_TOLERANCE_PER_BIN * in_params.B;
+	vote_stats.combine_time = 0;
+
 	//
 	// real stuff
 	//
@@ -62,18 +84,19 @@ Fragments_Tracker::Fragments_Tracker(CvMat* I, Parameters& in_params, ofstream&
 	}
 
 	//
-	// allocate space for the IIV_I and the combined votes maps
+	// the bin of every gray value, used when building integral histograms
 	//
 
-	CvMat* curr_ii;
-	
-	int i;
-	for (i=0; i<params->B; i++) {
-		
-		curr_ii = cvCreateMat(I->height,I->width,CV_32S);
-		
-		IIV_I.push_back(curr_ii);
-	}
+	init_pixel_bins();
+
+	//
+	// scales searched with params->scale_search, relative to the current one
+	//
+
+	curr_scale = 1;
+	scale_factors.push_back(0.95);
+	scale_factors.push_back(1.0);
+	scale_factors.push_back(1.05);
 
 	//
 	// initialize the template
@@ -81,25 +104,28 @@ Fragments_Tracker::Fragments_Tracker(CvMat* I, Parameters& in_params, ofstream&
 
 	int t_height = params->initial_br_y - params->initial_tl_y + 1;
 	int t_width = params->initial_br_x - params->initial_tl_x + 1;
+
+	//
+	// range of curr_scale: the template keeps a side of at least MIN_TEMPLATE_SIDE
+	// pixels (or its initial size if that is smaller) and fits into the image
+	//
+
+	min_scale = min ( 1.0 , (double)MIN_TEMPLATE_SIDE / min ( t_height , t_width ) );
+	max_scale = max ( 1.0 , min ( (double)I.rows / t_height , (double)I.cols / t_width ) );
 	
 	//
 	// define the template - gray-scale:
 	//
 
-	CvMat* tmp_ptr = cvCreateMat(t_height,t_width,CV_8U);
-
-	CvRect rect;
+	cv::Rect rect;
 	rect.x = params->initial_tl_x;
 	rect.y = params->initial_tl_y;
 	rect.width = t_width;
 	rect.height = t_height;
 
-	// get the pixels 
+	// copy the pixels 
 
-	cvGetSubRect(I,tmp_ptr,rect);
-
-	curr_template = cvCloneMat(tmp_ptr);
-	cvReleaseMat(&tmp_ptr);
+	curr_template = I(rect).clone();
 
 	//
 	// template center:
@@ -128,8 +154,8 @@ Fragments_Tracker::Fragments_Tracker(CvMat* I, Parameters& in_params, ofstream&
 	Draw_Rectangle(params->initial_tl_y, params->initial_tl_x,
 		           t_height, t_width, I);
 
-	cvSaveImage("initial_target.jpg",I);
-	cvSaveImage("initial_template.jpg",curr_template);
+	cv::imwrite("initial_target.jpg",I);
+	cv::imwrite("initial_template.jpg",curr_template);
 
 	//outf << endl << endl << "Finished init... here are the tracking results: " << endl << endl;
 
@@ -142,16 +168,6 @@ Fragments_Tracker::Fragments_Tracker(CvMat* I, Parameters& in_params, ofstream&
 
 Fragments_Tracker::~Fragments_Tracker(void)
 {
-	vector < CvMat* >::iterator it;
-	for ( it = IIV_I.begin() ; it != IIV_I.end() ; it++ ) {
-		cvReleaseMat ( &(*it) );
-	}
-	for ( it = IIV_T.begin() ; it != IIV_T.end() ; it++ ) {
-		cvReleaseMat ( &(*it) );
-	}
-	for ( it = patch_vote_maps.begin() ; it != patch_vote_maps.end() ; it++ ) {
-		cvReleaseMat ( &(*it) );
-	}
 	vector < Patch* >::iterator it2;
 	for ( it2 = patches.begin() ; it2 != patches.end() ; it2++ ) {
 		delete (*it2);
@@ -163,13 +179,13 @@ Fragments_Tracker::~Fragments_Tracker(void)
 // Routine for building the histograms of template patches/fragments 
 //
 
-void Fragments_Tracker::Build_Template_Patch_Histograms(CvMat* T,
+void Fragments_Tracker::Build_Template_Patch_Histograms(const cv::Mat& T,
 											   vector< vector<double>* >& patch_histograms)
 {
 	if (dbg==1)
 	{
 		outf << endl << "Building template patches histograms ... ";
-		outf << endl << "Template size: " << T->height << " " << T->width;
+		outf << endl << "Template size: " << T.rows << " " << T.cols;
 	}
 
 	//
@@ -188,26 +204,13 @@ void Fragments_Tracker::Build_Template_Patch_Histograms(CvMat* T,
 	// define the patches on this template
 	//
 
-    define_patches(T->height, T->width, patches);
+    define_patches(T.rows, T.cols, patches);
 
 	//
 	// compute the integral histogram on the template
 	//
 	
-	int i;
-	for (i=0; i<IIV_T.size(); i++) {
-		cvReleaseMat(&(IIV_T[i]));
-	}
-	IIV_T.clear();
-
-	CvMat* curr_ii;
-	for (i=0; i<params->B; i++) {
-
-		curr_ii = cvCreateMat(T->height,T->width,CV_32S);
-		
-		IIV_T.push_back(curr_ii);
-	}
-	compute_IH ( T , IIV_T );
+	compute_IH ( T , 0 , 0 , T.rows-1 , T.cols-1 , IH_T );
 	
 	//
 	// now compute the histograms for every defined patch
@@ -215,8 +218,8 @@ void Fragments_Tracker::Build_Template_Patch_Histograms(CvMat* T,
 
 	vector < double >* curr_histogram;
 	
-	int t_cx = (int)floor((double)T->width / 2.0 );
-	int t_cy = (int)floor((double)T->height / 2.0 );
+	int t_cx = (int)floor((double)T.cols / 2.0 );
+	int t_cy = (int)floor((double)T.rows / 2.0 );
 
 	if (dbg==1)
 	{
@@ -241,7 +244,7 @@ void Fragments_Tracker::Build_Template_Patch_Histograms(CvMat* T,
 		int p_cy = t_cy + (*it2)->dy;
 		
 		curr_histogram = new vector<double>;
-		compute_histogram ( p_cy-(*it2)->h , p_cx-(*it2)->w , p_cy+(*it2)->h , p_cx+(*it2)->w , IIV_T , *curr_histogram );
+		compute_histogram ( p_cy-(*it2)->h , p_cx-(*it2)->w , p_cy+(*it2)->h , p_cx+(*it2)->w , IH_T , *curr_histogram );
 
 		
 		patch_histograms.push_back(curr_histogram);
@@ -255,52 +258,17 @@ void Fragments_Tracker::Build_Template_Patch_Histograms(CvMat* T,
 }
 
 //
-// routine for initializing variables used in the EMD metric between two histograms
+// routine for initializing variables used in the EMD metric between two histograms.
+// The ground distance between two bins is the distance between their centers,
+// bin_gaps holds the distance between every bin and the next one
 //
 	
 void Fragments_Tracker::Init_EMD_Stuff()
 {
-	int Z = params->B;   // number of bins in histogram
-
-	//
-	// alocate vectors
-	//
-
-	F1 = new feature_t[256];
-	F2 = new feature_t[256];
-	w1 = new float[256];
-	w2 = new float[256];
-
-	//
-	// we assume the bins are numbered 0 to Z-1. We allow at most 256 bins
-	// the weights w1,w2 are initialized for every two histograms
-	//
-
-	for (int i=0; i<Z; i++)
-	{
-		F1[i]= i;
-		F2[i]= i;
-	}
-
-	//
-	// compute the distance between every two bins
-    //
-
-	bin_bin_distance_matrix = cvCreateMat(Z,Z,CV_32F);
-	cvSetZero(bin_bin_distance_matrix);
-		
-	init_bin_distance_matrix();
-
-	return;
-}
-
-
-void Fragments_Tracker::init_bin_distance_matrix()
-{
-	vector< double> bin_center;
 	double bin_width = floor ( 256. / (double)(params->B) );
 	int bi;
 	int L,R;
+	bin_centers.clear();
 	for (bi=0; bi<=params->B-1 ; bi++)
 	{
 		L = bi*bin_width;
@@ -310,32 +278,16 @@ void Fragments_Tracker::init_bin_distance_matrix()
 			R = 255;
 		}
 		double ctr = 0.5*(L+R);
-		bin_center.push_back(ctr);
+		bin_centers.push_back(ctr);
      }
 
-	/*
-	outf << endl << "Gray scale distance matrix: For each channel bin centers are: " << endl;
-	for (bi=0; bi < bin_center.size(); bi++)
-	{
-		outf << endl << bi << " " << bin_center[bi] ;
-	}
-    */
-
-	int Z = bin_bin_distance_matrix->height;  // number of bins we have
-	for (int v1=0; v1<=Z-2; v1++)
-	for (int v2=v1+1; v2<=Z-1; v2++)
+	bin_gaps.assign(params->B, 0.0f);
+	for (bi=0; bi<params->B-1; bi++)
 	{
-		double val_b1 = bin_center[v1];
-		double val_b2 = bin_center[v2];
-		
-		double zz = abs(val_b1-val_b2);
-
-		cvSetReal2D(bin_bin_distance_matrix,v1,v2,zz);
-		cvSetReal2D(bin_bin_distance_matrix,v2,v1,zz);
+		bin_gaps[bi] = (float)(bin_centers[bi+1] - bin_centers[bi]);
 	}
 
 	return;
-
 }
 
 
@@ -431,149 +383,156 @@ void Fragments_Tracker::define_patches(int height, int width, vector< Patch* >&
 }
 
 //
-// Get_Pixel_Bin - routine which bins the image I and returns the result
-// in bin_mat. 
+// init_pixel_bins - computes the bin of every gray value. The bins have width
+// floor(256/B), values beyond the last bin go into it
 //
 
-void Fragments_Tracker::Get_Pixel_Bin ( CvMat* I , CvMat* bin_mat)
+void Fragments_Tracker::init_pixel_bins()
 {
 	double bin_width = floor ( 256. / (double)(params->B) );
-	
-	for (int row=0; row<bin_mat->height; row++)
-	for (int col=0; col<bin_mat->width; col++)
+
+	for (int v=0; v<256; v++)
 	{
-		int b = (int)(floor ( cvGetReal2D ( I , row , col ) / bin_width ));
+		int b = (int)(floor ( v / bin_width ));
 		if ( b > (params->B - 1) ) 
 			b = params->B - 1;
 
-		cvmSet(bin_mat,row,col,b);
+		pixel_bin[v] = b;
 	}
 
 	return;
 }
 
 //
-// compute_IH - compute integral histogram. Also possible to use OpenCV's 
-// routine, however there is a difference in the size of matrices returned
+// patch_margins - how far the pixels of the patches reach from the template
+// center. Integral histograms have to cover the search region plus these margins
 //
 
-bool Fragments_Tracker::compute_IH( CvMat* I , vector < CvMat* >& vec_II )
+void Fragments_Tracker::patch_margins(vector< Patch >& patch_vec, int& margin_y, int& margin_x)
 {
-	int save_dbg = dbg;
-	//dbg = 0;
+	margin_y = 0;
+	margin_x = 0;
 
-	//reset IIV matrices
-	vector < CvMat* >::iterator it;
-	for ( it = vec_II.begin() ; it != vec_II.end() ; it++ ) {
-		cvSetZero ( (*it) );
+	for (int i=0; i<patch_vec.size(); i++)
+	{
+		margin_y = max ( margin_y , abs(patch_vec[i].dy) + patch_vec[i].h );
+		margin_x = max ( margin_x , abs(patch_vec[i].dx) + patch_vec[i].w );
 	}
 
+	return;
+}
 
-	CvMat* curr_bin_mat = cvCreateMat(I->height,I->width,CV_32F);
-	Get_Pixel_Bin ( I , curr_bin_mat);
+//
+// scale_patches - the patches of a target scale times the size of the template:
+// their offsets from the center and their half sizes are scaled and rounded
+//
 
-	//fill matrices
-	int i , j , currBin, count;
-	double vup , vleft , vdiag , z;
-	for ( i = 0 ; i < I->height ; i++ ) {
-		for ( j = 0 ; j < I->width ; j++ ) {
+void Fragments_Tracker::scale_patches(vector< Patch* >& patch_vec, double scale, vector< Patch >& scaled)
+{
+	scaled.resize(patch_vec.size());
 
+	for (int i=0; i<patch_vec.size(); i++)
+	{
+		scaled[i].dx = (int)floor ( patch_vec[i]->dx * scale + 0.5 );
+		scaled[i].dy = (int)floor ( patch_vec[i]->dy * scale + 0.5 );
+		scaled[i].w = (int)floor ( patch_vec[i]->w * scale + 0.5 );
+		scaled[i].h = (int)floor ( patch_vec[i]->h * scale + 0.5 );
+	}
 
-			currBin = cvmGet(curr_bin_mat,i,j);
+	return;
+}
 
-			for ( it = vec_II.begin() , count = 0 ; it != vec_II.end() ; it++ , count++ ) {
-				
-				if ( i == 0 ) {//no up
-					vup = 0;
-					vdiag = 0;
-				} else {
-					vup = cvGetReal2D ( (*it) , i-1 , j );
-					//vup = cvmGet ( (*it) , i-1 , j );
-				}
-				
-				if ( j == 0 ) {//no left
-					vleft = 0;
-					vdiag = 0;
-				} else {
-					vleft = cvGetReal2D ( (*it) , i , j-1 );
-					//vleft = cvmGet ( (*it) , i , j-1 );
-				}
+//
+// compute_IH - compute integral histogram of the region minrow..maxrow x mincol..maxcol
+// of the 8 bit image I (clipped to the image). One pass over the region: each row keeps
+// a running histogram of its pixels, which is added to the row above
+//
 
-				if ( i > 0 && j > 0 ) {//diag exists
-					vdiag = cvGetReal2D ( (*it) , i-1 , j-1 );
-					//vdiag = cvmGet ( (*it) , i-1 , j-1 );
-				}
+bool Fragments_Tracker::compute_IH( const cv::Mat& I , int minrow , int mincol , int maxrow , int maxcol ,
+								   Integral_Histogram& ih )
+{
+	if (minrow < 0) {minrow = 0;}
+	if (mincol < 0) {mincol = 0;}
+	if (maxrow >= I.rows) {maxrow = I.rows-1;}
+	if (maxcol >= I.cols) {maxcol = I.cols-1;}
 
-				//set cell value
-				z = vleft + vup - vdiag;
-				if ( currBin == count ) 
-					z++;
-				cvSetReal2D ( (*it) , i , j , (double)z );
-				//cvmSet ( (*it) , i , j , (double)z );
+	int B = params->B;
 
-			}//next it
+	ih.B = B;
+	ih.top = minrow;
+	ih.left = mincol;
+	ih.height = max ( maxrow - minrow + 1 , 0 );
+	ih.width = max ( maxcol - mincol + 1 , 0 );
+	ih.image_height = I.rows;
+	ih.image_width = I.cols;
+
+	int row_length = (ih.width+1) * B;
+	ih.data.resize ( (ih.height+1) * row_length );
+	ih.bins.resize ( ih.height * ih.width );
+
+	// first row is zero
+	std::fill ( ih.data.begin() , ih.data.begin() + row_length , 0 );
+
+	vector < int > row_hist(B);
+
+	for ( int i = 0 ; i < ih.height ; i++ ) {
+
+		const uchar* pixels = I.ptr<uchar>(minrow+i) + mincol;
+		uchar* bins = ih.bins.empty() ? NULL : &ih.bins[i * ih.width];
+		const int* up = &ih.data[i * row_length];
+		int* curr = &ih.data[(i+1) * row_length];
+
+		// first column is zero
+		std::fill ( curr , curr + B , 0 );
+		std::fill ( row_hist.begin() , row_hist.end() , 0 );
+
+		for ( int j = 0 ; j < ih.width ; j++ ) {
+
+			int b = pixel_bin[pixels[j]];
+			bins[j] = (uchar)b;
+			row_hist[b]++;
+
+			up += B;
+			curr += B;
+			for ( b = 0 ; b < B ; b++ ) {
+				curr[b] = up[b] + row_hist[b];
+			}
 		}//next j
 	}//next i
 
-	cvReleaseMat(&curr_bin_mat);
-
-	dbg = save_dbg;
 	return true;
 }
 
 //
 // compute_histogram - uses the integral histogram data structure to quickly compute
-// a histogram in a rectangular region
+// a normalized histogram in a rectangular region (in image coordinates)
 //
 
-bool Fragments_Tracker::compute_histogram ( int tl_y , int tl_x , int br_y , int br_x , vector < CvMat* >& iiv , vector < double >& hist )
+bool Fragments_Tracker::compute_histogram ( int tl_y , int tl_x , int br_y , int br_x , Integral_Histogram& ih , vector < double >& hist )
 {
-	vector < CvMat* >::iterator it;
-	hist.clear();
-	double left , up , diag;
-	double sum = 0;
-	double z;
-	for ( it = iiv.begin() ; it != iiv.end() ; it++ ) {
-		if ( tl_x == 0 ) {
-			left = 0;
-			diag = 0;
-		} else {
-			left = cvGetReal2D ( (*it) , br_y , tl_x - 1 );
-			//left = cvmGet ( (*it) , br_y , tl_x - 1 );
-		}
+	int B = ih.B;
+	int row_length = (ih.width+1) * B;
 
-		if ( tl_y == 0 ) {
-			up = 0;
-			diag = 0;
-		} else {
-			up = cvGetReal2D ( (*it) , tl_y - 1 , br_x );
-			//up = cvmGet ( (*it) , tl_y - 1 , br_x );
-		}
-		if ( tl_x > 0 && tl_y > 0 ) {
-			diag = cvGetReal2D ( (*it) , tl_y - 1 , tl_x - 1 );
-			//diag = cvmGet ( (*it) , tl_y - 1 , tl_x - 1 );
-		}
-		z = cvGetReal2D ( (*it) , br_y , br_x ) - left - up + diag;
-		//z = cvmGet ( (*it) , br_y , br_x ) - left - up + diag;
-		hist.push_back(z);
+	// corners in the padded region
+	const int* tl = &ih.data[(tl_y - ih.top) * row_length + (tl_x - ih.left) * B];
+	const int* tr = &ih.data[(tl_y - ih.top) * row_length + (br_x + 1 - ih.left) * B];
+	const int* bl = &ih.data[(br_y + 1 - ih.top) * row_length + (tl_x - ih.left) * B];
+	const int* br = &ih.data[(br_y + 1 - ih.top) * row_length + (br_x + 1 - ih.left) * B];
+
+	hist.resize(B);
+	double sum = 0;
+	int b;
+	for ( b = 0 ; b < B ; b++ ) {
+		double z = br[b] - bl[b] - tr[b] + tl[b];
+		hist[b] = z;
 		sum += z;
 	}
-	vector < double >::iterator it2;
-	for ( it2 = hist.begin() ; it2 != hist.end() ; it2++ ) {
-		(*it2) /= sum;
+	for ( b = 0 ; b < B ; b++ ) {
+		hist[b] /= sum;
 	}
 	return true;
 }
 
-//
-// my_dist - the routine used by EMD to compute distance between two bins
-//
-
-float my_dist(feature_t* F1, feature_t* F2)
-{
-	return ((float) cvGetReal2D(bin_bin_distance_matrix,(*F1),(*F2)));
-}
-
 //
 // compare_histograms - returns their chi-square distance
 //
@@ -596,33 +555,13 @@ double Fragments_Tracker::compare_histograms ( vector < double >& h1 , vector <
 
 //
 // compare_histograms_emd - returns their EMD distance
-// Uses Yossi Rubner's original code
+// For our one-dimensional bins this is the distance between the cdfs, each
+// difference weighted by the gap to the next bin center (see emd_1d)
 //
 
 double Fragments_Tracker::compare_histograms_emd(vector<double>& h1, vector<double>& h2)
 {
-	//
-	// copy the vectors into the arrays
-	//
-
-	int Z = h1.size();    // number of bins
-	for (int i=0; i<Z; i++)
-	{
-		w1[i]=(float) h1[i];
-		w2[i]=(float) h2[i];
-	}
-
-	//
-	// define "signature"
-	//
-
-	signature_t s1 = { Z, F1, w1};
-	signature_t s2 = { Z, F2, w2};
-
-	float E = emd(&s1, &s2, my_dist, 0, 0);
-
-	return E;
-
+	return emd_1d ( h1.size() , &h1[0] , &h2[0] , &bin_centers[0] );
 }
 
 //
@@ -647,34 +586,287 @@ double Fragments_Tracker::compare_histograms_ks( vector < double >& h1 , vector
 		cdf2 = cdf2 + (*it2);
 
 		z = cdf1 - cdf2;
-		sum += abs(z);
+		sum += fabs(z);
 		ctr = ctr + 1;
 	}
 	return (sum/ctr);
 }
 
 //
-// compute_single_patch_votes - computes the votes map associated with a single patch
+// distance kernels used for voting. They work directly on the four corners of
+// a patch in the integral histogram, the patch histogram is (br-bl-tr+tl)/area.
+// The template side is given as float bins: its cdf for KS and EMD, its histogram
+// for chi-square
 //
 
-void Fragments_Tracker::compute_single_patch_votes ( Patch* p , vector < double >& hist ,
-										   int minrow, int mincol,
-										   int maxrow, int maxcol,
-										   CvMat* votes, int& min_r, int& min_c,
-										   int& max_r, int& max_c)
+#ifdef __SSE2__
+static inline __m128i corner_counts ( const int* tl , const int* tr , const int* bl , const int* br )
 {
-	int save_dbg = dbg;
-	dbg = 0;
+	__m128i z = _mm_sub_epi32 ( _mm_loadu_si128((const __m128i*)br) , _mm_loadu_si128((const __m128i*)bl) );
+	z = _mm_sub_epi32 ( z , _mm_loadu_si128((const __m128i*)tr) );
+	return _mm_add_epi32 ( z , _mm_loadu_si128((const __m128i*)tl) );
+}
 
-	if (dbg==1)
-	{
-		outf << endl << "Entering single patch votes ... " << endl;
-		outf << endl << "Patch center dy dx  = " << p->dy << " " << p->dx << " patch h w = " << p->h << " " << p->w;
-		outf << endl << "Voting for target center in region [" << minrow << "," << maxrow << "]x[" << mincol << "," << maxcol << "]" << endl;
+static inline float horizontal_sum ( __m128 v )
+{
+	v = _mm_add_ps ( v , _mm_movehl_ps(v,v) );
+	v = _mm_add_ss ( v , _mm_shuffle_ps(v,v,1) );
+	return _mm_cvtss_f32(v);
+}
+#endif
+
+static float distance_ks ( const int* tl , const int* tr , const int* bl , const int* br ,
+						   const float* template_cdf , float inv_area , int B )
+{
+	float sum = 0;
+	int count = 0;   // cdf of the patch, in pixels
+	int b = 0;
+
+#ifdef __SSE2__
+	__m128 acc = _mm_setzero_ps();
+	__m128 scale = _mm_set1_ps(inv_area);
+	__m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128i carry = _mm_setzero_si128();
+	for ( ; b + 4 <= B ; b += 4 ) {
+		// prefix sum of 4 bins plus the cdf of the bins before
+		__m128i c = corner_counts ( tl+b , tr+b , bl+b , br+b );
+		c = _mm_add_epi32 ( c , _mm_slli_si128(c,4) );
+		c = _mm_add_epi32 ( c , _mm_slli_si128(c,8) );
+		c = _mm_add_epi32 ( c , carry );
+		carry = _mm_shuffle_epi32 ( c , _MM_SHUFFLE(3,3,3,3) );
+
+		__m128 z = _mm_sub_ps ( _mm_mul_ps(_mm_cvtepi32_ps(c),scale) , _mm_loadu_ps(template_cdf+b) );
+		acc = _mm_add_ps ( acc , _mm_and_ps(z,abs_mask) );
+	}
+	sum = horizontal_sum(acc);
+	count = _mm_cvtsi128_si32(carry);
+#endif
+
+	for ( ; b < B ; b++ ) {
+		count += br[b] - bl[b] - tr[b] + tl[b];
+		sum += fabs ( count * inv_area - template_cdf[b] );
 	}
+	return sum / B;
+}
+
+static float distance_emd ( const int* tl , const int* tr , const int* bl , const int* br ,
+							const float* template_cdf , const float* bin_gaps , float inv_area , int B )
+{
+	float sum = 0;
+	int count = 0;   // cdf of the patch, in pixels
+	int b = 0;
+
+#ifdef __SSE2__
+	__m128 acc = _mm_setzero_ps();
+	__m128 scale = _mm_set1_ps(inv_area);
+	__m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128i carry = _mm_setzero_si128();
+	for ( ; b + 4 <= B ; b += 4 ) {
+		__m128i c = corner_counts ( tl+b , tr+b , bl+b , br+b );
+		c = _mm_add_epi32 ( c , _mm_slli_si128(c,4) );
+		c = _mm_add_epi32 ( c , _mm_slli_si128(c,8) );
+		c = _mm_add_epi32 ( c , carry );
+		carry = _mm_shuffle_epi32 ( c , _MM_SHUFFLE(3,3,3,3) );
+
+		__m128 z = _mm_sub_ps ( _mm_mul_ps(_mm_cvtepi32_ps(c),scale) , _mm_loadu_ps(template_cdf+b) );
+		acc = _mm_add_ps ( acc , _mm_mul_ps(_mm_and_ps(z,abs_mask),_mm_loadu_ps(bin_gaps+b)) );
+	}
+	sum = horizontal_sum(acc);
+	count = _mm_cvtsi128_si32(carry);
+#endif
+
+	for ( ; b < B ; b++ ) {
+		count += br[b] - bl[b] - tr[b] + tl[b];
+		sum += fabs ( count * inv_area - template_cdf[b] ) * bin_gaps[b];
+	}
+	return sum;
+}
+
+static float distance_chi_square ( const int* tl , const int* tr , const int* bl , const int* br ,
+								   const float* template_hist , float inv_area , int B )
+{
+	float sum = 0;
+	int b = 0;
+
+#ifdef __SSE2__
+	__m128 acc = _mm_setzero_ps();
+	__m128 scale = _mm_set1_ps(inv_area);
+	__m128 zero = _mm_setzero_ps();
+	for ( ; b + 4 <= B ; b += 4 ) {
+		__m128 h = _mm_mul_ps ( _mm_cvtepi32_ps(corner_counts(tl+b,tr+b,bl+b,br+b)) , scale );
+		__m128 t = _mm_loadu_ps(template_hist+b);
+		__m128 z = _mm_sub_ps(t,h);
+		__m128 y = _mm_add_ps(t,h);
+		// bins empty in both histograms do not count (y == 0 implies z == 0)
+		acc = _mm_add_ps ( acc , _mm_and_ps(_mm_div_ps(_mm_mul_ps(z,z),y),_mm_cmpgt_ps(y,zero)) );
+	}
+	sum = horizontal_sum(acc);
+#endif
+
+	for ( ; b < B ; b++ ) {
+		float h = (br[b] - bl[b] - tr[b] + tl[b]) * inv_area;
+		float z = template_hist[b] - h;
+		float y = template_hist[b] + h;
+		if (z != 0)
+		{
+			sum += z*z/y;
+		}
+	}
+	return sum;
+}
+
+//
+// vote_term - the term of one bin in the score of a patch: |cdf - template cdf| for KS
+// and EMD, the chi-square term of the histograms otherwise
+//
+
+static inline double vote_term ( double h , double t , bool cumulative )
+{
+	if ( cumulative )
+		return fabs ( h - t );
+
+	double z = t - h;
+	return (z != 0) ? z*z / (t + h) : 0;
+}
 
-	int M = (*IIV_I.begin())->height;
-	int N = (*IIV_I.begin())->width;
+//
+// slide_patch_votes - computes the same votes as compute_single_patch_votes, but slides the patch across the region instead of building its histogram
+// at every position. Moving by one position replaces one column (or row) of pixels,
+// and only the terms of the score whose bins change are updated. The patch slides
+// along the axis where it is thinner, so that the fewest pixels change
+//
+
+void Fragments_Tracker::slide_patch_votes ( Patch* p , const float* template_bins ,
+										   int miny , int maxy , int minx , int maxx ,
+										   int minrow , int mincol , cv::Mat& votes ,
+										   Vote_Scratch& scratch )
+{
+	int B = IH_I.B;
+	int row_length = (IH_I.width+1) * B;
+	int patch_height = 2*p->h+1;
+	int patch_width = 2*p->w+1;
+	double inv_area = 1.0 / (patch_height*patch_width);
+	bool ks = (params->metric_used == 3);
+	bool cumulative = (params->metric_used != 1);   // KS and EMD compare cdfs
+	const float* gaps = (params->metric_used == 2) ? &bin_gaps[0] : NULL;
+
+	// slide along x when the column that changes is shorter than a row
+	bool along_x = (patch_height <= patch_width);
+	int outer_min = along_x ? miny : minx;
+	int outer_max = along_x ? maxy : maxx;
+	int inner_min = along_x ? minx : miny;
+	int inner_max = along_x ? maxx : maxy;
+	int changed = along_x ? patch_height : patch_width;             // pixels replaced per step
+	int changed_step = along_x ? IH_I.width : 1;                    // between them in IH_I.bins
+	int added_offset = along_x ? patch_width : patch_height * IH_I.width;   // from the removed to the added pixels
+	int window_step = along_x ? 1 : IH_I.width;                     // of the window per step
+	int vote_step = along_x ? 1 : (int)votes.step1();
+
+	// counts holds the cumulative histogram (in pixels) for KS and EMD, the histogram for chi-square
+	scratch.counts.resize(B);
+	scratch.terms.resize(B);
+	int* counts = &scratch.counts[0];
+	double* terms = &scratch.terms[0];
+
+	for ( int outer = outer_min ; outer <= outer_max ; outer++ ) {
+
+		int y = along_x ? outer : inner_min;
+		int x = along_x ? inner_min : outer;
+
+		//
+		// histogram at the first position from the integral histogram, the total
+		// is recomputed here so that rounding errors do not carry over
+		//
+
+		const int* tl = &IH_I.data[(y-p->h-IH_I.top) * row_length + (x-p->w-IH_I.left) * B];
+		const int* tr = tl + patch_width * B;
+		const int* bl = tl + patch_height * row_length;
+		const int* br = bl + patch_width * B;
+
+		double total = 0;
+		int cdf = 0;
+		for ( int b = 0 ; b < B ; b++ ) {
+			int count = br[b] - bl[b] - tr[b] + tl[b];
+			cdf += count;
+			counts[b] = cumulative ? cdf : count;
+			terms[b] = vote_term ( counts[b] * inv_area , template_bins[b] , cumulative );
+			if ( gaps )
+				terms[b] *= gaps[b];
+			total += terms[b];
+		}
+
+		const uchar* removed = &IH_I.bins[(y-p->h-IH_I.top) * IH_I.width + (x-p->w-IH_I.left)];
+		float* vote = votes.ptr<float>(y-p->dy-minrow) + (x-p->dx-mincol);
+
+		for ( int inner = inner_min ; ; inner++ ) {
+
+			*vote = (float)(ks ? total / B : total);
+
+			if ( inner == inner_max )
+				break;
+
+			//
+			// replace the pixels leaving the patch by those entering it
+			//
+
+			for ( int k = 0 ; k < changed ; k++ ) {
+				int a = removed[k * changed_step];
+				int c = removed[k * changed_step + added_offset];
+				if ( a == c )
+					continue;
+
+				if ( cumulative ) {
+					// the cdf changes between the two bins only
+					int first = min(a,c);
+					int last = max(a,c);
+					int delta = (a < c) ? -1 : 1;
+					for ( int b = first ; b < last ; b++ ) {
+						counts[b] += delta;
+						double t = vote_term ( counts[b] * inv_area , template_bins[b] , true );
+						if ( gaps )
+							t *= gaps[b];
+						total += t - terms[b];
+						terms[b] = t;
+					}
+				} else {
+					counts[a]--;
+					counts[c]++;
+					double ta = vote_term ( counts[a] * inv_area , template_bins[a] , false );
+					double tc = vote_term ( counts[c] * inv_area , template_bins[c] , false );
+					total += ta - terms[a] + tc - terms[c];
+					terms[a] = ta;
+					terms[c] = tc;
+				}
+			}
+
+			removed += window_step;
+			vote += vote_step;
+		}
+	}
+
+	return;
+}
+
+//
+// compute_single_patch_votes - computes the votes map associated with a single patch.
+// template_bins holds the template patch histogram as floats for the distance kernels
+// (its cdf for metrics 2 and 3). With incremental, the votes are computed by
+// slide_patch_votes. With reference_hist, the template patch histogram in double
+// precision, they are computed at every position by compute_histogram and
+// compare_histograms*, as the reference for both float paths. Runs concurrently
+// for different patches, so it must not change the tracker
+//
+
+void Fragments_Tracker::compute_single_patch_votes ( Patch* p , const float* template_bins,
+										   vector<double>* reference_hist,
+										   int minrow, int mincol,
+										   int maxrow, int maxcol,
+										   cv::Mat& votes, bool incremental, Vote_Scratch& scratch,
+										   int& min_r, int& min_c,
+										   int& max_r, int& max_c)
+{
+	int M = IH_I.image_height;
+	int N = IH_I.image_width;
 	int minx , maxx , miny, maxy;
 	//compute left margin
 	if ( p->w > p->dx ) {
@@ -711,74 +903,203 @@ void Fragments_Tracker::compute_single_patch_votes ( Patch* p , vector < double
 	if (minx<mincol+p->dx) {minx = mincol+p->dx;}
 	if (maxx>maxcol+p->dx) {maxx = maxcol+p->dx;}
 
-	cvSet( votes, cvScalar(1000.0) );
+	votes.setTo( cv::Scalar(1000.0) );
+
+	//
+	// return the region where votes were added
+	//
+
+	min_c = minx-p->dx;
+	max_c = maxx-p->dx;
+	min_r = miny-p->dy;
+	max_r = maxy-p->dy;
+
+	if ( incremental )
+	{
+		if ( miny <= maxy && minx <= maxx )
+			slide_patch_votes ( p , template_bins , miny , maxy , minx , maxx , minrow , mincol , votes , scratch );
+		return;
+	}
+
 	int x , y;
 	double z = 0;
-	double sum_z = 0;
-	double t = 0;
-	vector < double > curr_hist;
 
-	if (dbg == 1)
+	if ( reference_hist )
 	{
-		outf << endl << "patch center runs  in the region [" << miny << "," << maxy << "]x[" << minx << "," << maxx << "]" << endl;
+		for ( y = miny ; y <= maxy ; y++ ) {
+			float* votes_row = votes.ptr<float>(y-p->dy-minrow) - p->dx - mincol;
+			for ( x = minx ; x <= maxx ; x++ ) {
+				compute_histogram ( y-p->h , x-p->w , y+p->h , x+p->w , IH_I , scratch.hist );
+
+				if (params->metric_used == 1) z = compare_histograms(scratch.hist,*reference_hist);
+				if (params->metric_used == 2) z = compare_histograms_emd(scratch.hist,*reference_hist);
+				if (params->metric_used == 3) z = compare_histograms_ks(scratch.hist,*reference_hist);
+
+				votes_row[x] = (float)z;
+			}
+		}
+		return;
 	}
 
-	for ( x = minx ; x <= maxx ; x++ ) {
-		for ( y = miny ; y <= maxy ; y++ ) {
+	int B = IH_I.B;
+	int row_length = (IH_I.width+1) * B;
+	int patch_height = 2*p->h+1;
+	int patch_width = 2*p->w+1;
+	float inv_area = 1.0f / (patch_height*patch_width);
+
+	for ( y = miny ; y <= maxy ; y++ ) {
+
+		//
+		// now the votemap is not the whole image but only the portion between
+		// min-max row-col
+		// so y-dy=minrow --> vote for index = 0
+		// 
 
-			compute_histogram ( y-p->h , x-p->w , y+p->h , x+p->w, IIV_I , curr_hist );
-			
+		float* votes_row = votes.ptr<float>(y-p->dy-minrow) - p->dx - mincol;
+
+		// corners of the patch at x = minx, moving right by one position moves them by B
+		const int* tl = &IH_I.data[(y-p->h-IH_I.top) * row_length + (minx-p->w-IH_I.left) * B];
+		const int* tr = tl + patch_width * B;
+		const int* bl = tl + patch_height * row_length;
+		const int* br = bl + patch_width * B;
+
+		for ( x = minx ; x <= maxx ; x++ , tl += B , tr += B , bl += B , br += B ) {
 
 			//
 			// compare the two histograms
 			//
 
-			if (params->metric_used == 1) z = compare_histograms(hist,curr_hist);
-			if (params->metric_used == 2) z = compare_histograms_emd(hist,curr_hist);
-			if (params->metric_used == 3) z = compare_histograms_ks(hist,curr_hist);
-			
-			if (dbg == 1)
-			{
-				outf << endl << "The distance between this hist and the template hist is " << z << endl;
-			}
-			
+			if (params->metric_used == 1) z = distance_chi_square(tl,tr,bl,br,template_bins,inv_area,B);
+			if (params->metric_used == 2) z = distance_emd(tl,tr,bl,br,template_bins,&bin_gaps[0],inv_area,B);
+			if (params->metric_used == 3) z = distance_ks(tl,tr,bl,br,template_bins,inv_area,B);
+
+			votes_row[x] = (float)z;
+
+		}
+	}
+
+	return;
+}
+
+//
+// Patch_Votes - computes the vote maps of a range of patches, and the position
+// each of them votes for. The range runs over the patches of all scale searches,
+// search k / Z patch k % Z. Every range has its own scratch space. The reference
+// votes, in double precision against patch_histograms, go to check_cube, without positions
+//
+
+class Patch_Votes : public cv::ParallelLoopBody
+{
+public:
+	Patch_Votes(Fragments_Tracker& tracker, vector< Scale_Search >& searches, vector< float >& template_bins,
+				vector< vector<double>* >& patch_histograms,
+				int minrow, int mincol, int maxrow, int maxcol, bool incremental, bool reference) :
+		tracker(tracker), searches(searches),
+		template_bins(template_bins), patch_histograms(patch_histograms),
+		minrow(minrow), mincol(mincol), maxrow(maxrow), maxcol(maxcol),
+		incremental(incremental), reference(reference) {}
+
+	virtual void operator()(const cv::Range& range) const
+	{
+		Vote_Scratch scratch;
+		Vote_Region check_region;
+		int B = tracker.params->B;
+		int Z = searches[0].patches.size();
+
+		for (int k = range.start; k < range.end; k++)
+		{
+			Scale_Search& search = searches[k / Z];
+			int i = k % Z;
+			cv::Mat& votes = reference ? search.check_cube.maps[i] : search.vote_cube.maps[i];
+			Vote_Region& r = reference ? check_region : search.vote_regions[i];
+			tracker.compute_single_patch_votes ( &search.patches[i] , &template_bins[i*B] ,
+												 reference ? patch_histograms[i] : NULL ,
+												 minrow, mincol, maxrow, maxcol, votes, incremental, scratch,
+												 r.minrow, r.mincol, r.maxrow, r.maxcol );
+
+			if (reference)
+				continue;
+
+			//
+			// find the position based on this patch:
 			//
-			// now the votemap is not the whole image but only the portion between
-			// min-max row-col
-			// so y-dy=minrow --> vote for index = 0
-			// 
 
-			cvSetReal2D ( votes , y-p->dy-minrow , x-p->dx-mincol , z );
+			cv::Point min_loc;
+			cv::Point max_loc;
+			double minval;
+			double maxval;
 
+			cv::minMaxLoc(votes,&minval,&maxval,&min_loc,&max_loc);
+
+			search.x_coords[i] = mincol+min_loc.x;
+			search.y_coords[i] = minrow+min_loc.y;
+			search.patch_scores[i] = minval;
 		}
 	}
 
-	//
-	// return the region where votes were added
-	//
+private:
+	Fragments_Tracker& tracker;
+	vector< Scale_Search >& searches;
+	vector< float >& template_bins;
+	vector< vector<double>* >& patch_histograms;
+	int minrow, mincol, maxrow, maxcol;
+	bool incremental;
+	bool reference;
+};
 
-	min_c = minx-p->dx;
-	max_c = maxx-p->dx;
-	min_r = miny-p->dy;
-	max_r = maxy-p->dy;
+//
+// shape_vote_cube - makes room for Z vote maps of the given size, the memory
+// of the cube only grows
+//
 
-	dbg = save_dbg;
-	return;
+void Fragments_Tracker::shape_vote_cube(Vote_Cube& cube, int Z, int height, int width)
+{
+	cube.Z = Z;
+	cube.height = height;
+	cube.width = width;
+
+	if (cube.data.size() < Z * height * width)
+	{
+		cube.data.resize(Z * height * width);
+	}
+
+	cube.maps.resize(Z);
+	for (int i = 0; i < Z; i++)
+	{
+		cube.maps[i] = cv::Mat(height, width, CV_32F, &cube.data[i * height * width]);
+	}
+}
+
+//
+// compare_vote_cubes - raises max_difference to the largest difference of a vote
+// to its reference, relative to the reference but at least 1
+//
+
+void Fragments_Tracker::compare_vote_cubes(Vote_Cube& cube, Vote_Cube& reference, double& max_difference)
+{
+	int n = cube.Z * cube.height * cube.width;
+	for (int k = 0; k < n; k++)
+	{
+		double d = fabs ( cube.data[k] - reference.data[k] ) / max ( 1.0 , fabs ( (double)reference.data[k] ) );
+		if (d > max_difference)
+			max_difference = d;
+	}
 }
 
 //
-// compute_all_patch_votes - runs on all patches and computes each one's vote map
-// Then combines all the votes maps (robustly) to a single vote map
+// compute_all_patch_votes - runs on all patches of every scale search and computes
+// each one's vote map. Then combines the vote maps of each search (robustly) to
+// its combined_vote. The patches of all searches vote in parallel.
+// With params->incremental_votes == 2 the votes are also computed in double
+// precision, at every position in float and incrementally, all three are timed
+// and both float paths are compared to the double reference in vote_stats
 //
 
 void Fragments_Tracker::compute_all_patch_votes(vector< vector<double>* >& patch_histograms,
-										 vector< Patch* >& tested_patches,
+										 vector< Scale_Search >& scale_searches,
 										 int img_height, int img_width,
    										 int minrow, int mincol,
-										 int maxrow, int maxcol , CvMat* combined_vote,
-										 vector<int>& x_coords,
-										 vector<int>& y_coords,
-										 vector<double>& patch_scores) 
+										 int maxrow, int maxcol) 
 {
 	int save_dbg = dbg;
 
@@ -788,119 +1109,175 @@ void Fragments_Tracker::compute_all_patch_votes(vector< vector<double>* >& patch
 	}
 
 	//
-	// pass on every patch and build its vote map
-	// note: we allocate the vote map matrices in this loop
+	// the vote maps of all patches of a search in one block, reused across frames
 	//
 
-	vector < Patch* >::iterator it;
-	
-	CvMat* curr_vm;
-	vector < double >* curr_patch_histogram;
-
-	patch_vote_maps.clear();
-	x_coords.clear();
-	y_coords.clear();
-	patch_scores.clear();
-
-	vector<int> vote_regions_minrow; 
-	vector<int> vote_regions_mincol;
-	vector<int> vote_regions_maxrow;
-	vector<int> vote_regions_maxcol;
-
-	int minx,miny,maxx,maxy;
+	int S = scale_searches.size();
+	int Z = patch_histograms.size();
+	int B = params->B;
 
 	int vm_width = maxcol-mincol+1;
 	int vm_height = maxrow-minrow+1;
 
-	int i = -1;
-	for ( it = tested_patches.begin() ; it != tested_patches.end() ; it++) {
+	for (int s = 0; s < S; s++)
+	{
+		Scale_Search& search = scale_searches[s];
+		shape_vote_cube(search.vote_cube, Z, vm_height, vm_width);
+		if (params->incremental_votes == 2)
+		{
+			shape_vote_cube(search.check_cube, Z, vm_height, vm_width);
+		}
 
-		curr_vm = cvCreateMat(vm_height,vm_width,CV_32F);
+		search.x_coords.resize(Z);
+		search.y_coords.resize(Z);
+		search.patch_scores.resize(Z);
+		search.vote_regions.resize(Z);
+	}
 
-		//
-		// compute current patch histogram
-		//
-		
-		i = i + 1;
-		curr_patch_histogram = patch_histograms[i];
+	//
+	// the template patch histograms as floats, cumulative for KS and EMD
+	//
 
-		if (dbg==1)
+	template_bins.resize(Z*B);
+	for (int i = 0; i < Z; i++)
+	{
+		double cdf = 0;
+		for (int b = 0; b < B; b++)
 		{
-			outf << endl << "The current patch number i= " << i << " histogram is : " << endl;
-			//util_object.PrintVec_to_stream(*curr_patch_histogram,outf);
-			outf << endl << endl << "Going to vote with this patch ... ";
+			cdf += (*patch_histograms[i])[b];
+			template_bins[i*B+b] = (float)(params->metric_used != 1 ? cdf : (*patch_histograms[i])[b]);
 		}
+	}
 
-		compute_single_patch_votes ( (*it) , *curr_patch_histogram , minrow, mincol,
-							          maxrow, maxcol, curr_vm, miny, minx, maxy, maxx );
+	//
+	// benchmark: compute the votes at every position in double precision as reference
+	//
 
-		patch_vote_maps.push_back(curr_vm);
-		vote_regions_minrow.push_back(miny);
-		vote_regions_mincol.push_back(minx);
-		vote_regions_maxrow.push_back(maxy);
-		vote_regions_maxcol.push_back(maxx);
+	int64 start;
 
-		//
-		// find the position based on this patch:
-		//
+	if (params->incremental_votes == 2)
+	{
+		start = cv::getTickCount();
+		cv::parallel_for_(cv::Range(0, S*Z), Patch_Votes(*this, scale_searches, template_bins, patch_histograms,
+									minrow, mincol, maxrow, maxcol, false, true));
+		vote_stats.reference_time += (cv::getTickCount() - start) / cv::getTickFrequency();
 
-		CvPoint min_loc;
-		CvPoint max_loc;
-		double minval;
-		double maxval;
+		start = cv::getTickCount();
+		cv::parallel_for_(cv::Range(0, S*Z), Patch_Votes(*this, scale_searches, template_bins, patch_histograms,
+									minrow, mincol, maxrow, maxcol, false, false));
+		vote_stats.per_position_time += (cv::getTickCount() - start) / cv::getTickFrequency();
 
-		cvMinMaxLoc(curr_vm,&minval,&maxval,&min_loc,&max_loc,NULL);
-		
-		x_coords.push_back(mincol+min_loc.x);
-		y_coords.push_back(minrow+min_loc.y);
-		patch_scores.push_back(minval);
-
-		if (dbg == 1)
+		for (int s = 0; s < S; s++)
 		{
-			outf << endl << "Patch " << i << " votes for point yx = " << min_loc.y << " " << min_loc.x << " (in vote-map coords) with score = " << minval;
-			outf << endl << "In image coords this is  point yx = " << (minrow+min_loc.y) << " " << (mincol+min_loc.x);
-			outf << endl << "Moving on to next patch ... " << endl;
+			compare_vote_cubes ( scale_searches[s].vote_cube , scale_searches[s].check_cube ,
+								 vote_stats.max_difference_per_position );
 		}
-
-	}  // next patch
+	}
 
 	//
-	// combine patch votes - using a quantile based score makes this combination
-	// robust to occlusions
+	// pass on every patch and build its vote map
 	//
 
-	Combine_Vote_Maps_Median(patch_vote_maps, combined_vote);
+	start = cv::getTickCount();
+	cv::parallel_for_(cv::Range(0, S*Z), Patch_Votes(*this, scale_searches, template_bins, patch_histograms,
+								minrow, mincol, maxrow, maxcol, params->incremental_votes != 0, false));
+	vote_stats.vote_time += (cv::getTickCount() - start) / cv::getTickFrequency();
+	vote_stats.frames++;
+
+	if (params->incremental_votes == 2)
+	{
+		for (int s = 0; s < S; s++)
+		{
+			compare_vote_cubes ( scale_searches[s].vote_cube , scale_searches[s].check_cube ,
+								 vote_stats.max_difference );
+		}
+	}
+
+	if (dbg == 1)
+	{
+		for (int s = 0; s < S; s++)
+		for (int i = 0; i < Z; i++)
+		{
+			Scale_Search& search = scale_searches[s];
+			outf << endl << "Scale " << search.scale << " patch " << i << " votes for point yx = " << (search.y_coords[i]-minrow) << " " << (search.x_coords[i]-mincol) << " (in vote-map coords) with score = " << search.patch_scores[i];
+			outf << endl << "In image coords this is  point yx = " << search.y_coords[i] << " " << search.x_coords[i];
+		}
+	}
 
 	//
-	// release stuff 
+	// combine patch votes - using a quantile based score makes this combination
+	// robust to occlusions
 	//
 
-	vector< CvMat* >::iterator vm_it;
-	for (vm_it = patch_vote_maps.begin(); vm_it != patch_vote_maps.end(); vm_it++)
+	start = cv::getTickCount();
+	for (int s = 0; s < S; s++)
 	{
-		cvReleaseMat(&(*vm_it));
+		Combine_Vote_Maps_Median(scale_searches[s].vote_cube, scale_searches[s].combined_vote);
 	}
-	patch_vote_maps.clear();
+	vote_stats.combine_time += (cv::getTickCount() - start) / cv::getTickFrequency();
 
 	dbg = save_dbg;
 	return;
 }
 
 //
-// Combine_Vote_Maps_Median - at each hypothesis sorts the score given by each patch
-// and takes the Q'th quantile as the score. This ignores outlier scores contributed
+// Combine_Rows - combines the vote maps of a range of rows. The Z votes of the
+// pixels in a row are gathered next to each other, reading each vote map row in order
+//
+
+class Combine_Rows : public cv::ParallelLoopBody
+{
+public:
+	Combine_Rows(Vote_Cube& cube, int Q_index, cv::Mat& V) : cube(cube), Q_index(Q_index), V(V) {}
+
+	virtual void operator()(const cv::Range& range) const
+	{
+		int Z = cube.Z;
+		int M = cube.height;
+		int N = cube.width;
+
+		vector< float > Fv(N*Z);
+
+		for (int i = range.start; i < range.end; i++)
+		{
+			for (int p = 0; p < Z; p++)
+			{
+				const float* map_row = &cube.data[(p*M + i)*N];
+				for (int j = 0; j < N; j++)
+				{
+					Fv[j*Z + p] = map_row[j];
+				}
+			}
+
+			float* V_row = V.ptr<float>(i);
+			for (int j = 0; j < N; j++)
+			{
+				float* pixel_votes = &Fv[j*Z];
+				std::nth_element(pixel_votes, pixel_votes + Q_index, pixel_votes + Z);
+				V_row[j] = pixel_votes[Q_index];
+			}
+		}
+	}
+
+private:
+	Vote_Cube& cube;
+	int Q_index;
+	cv::Mat& V;
+};
+
+//
+// Combine_Vote_Maps_Median - at each hypothesis selects the Q'th quantile of the scores
+// given by the patches as the score. This ignores outlier scores contributed
 // by patches affected by occlusions for example
 //
 
-void Fragments_Tracker::Combine_Vote_Maps_Median(vector< CvMat* >& vote_maps, CvMat* V)
+void Fragments_Tracker::Combine_Vote_Maps_Median(Vote_Cube& cube, cv::Mat& V)
 {
-	int M = (vote_maps[0])->height;
-	int N = (vote_maps[0])->width;
+	int M = cube.height;
+	int N = cube.width;
 
-	int Z = vote_maps.size();
+	int Z = cube.Z;
 	
-	vector< double > Fv;
-
 	int Q_index = (int) floor(((double) Z) / 4.0);
 	//Q_index = 4;
 
@@ -912,25 +1289,10 @@ void Fragments_Tracker::Combine_Vote_Maps_Median(vector< CvMat* >& vote_maps, Cv
 		outf << flush;
 	}
 
-	for (int i=0; i<M; i++)
-	for (int j=0; j<N; j++)
-	{
-		// take all the values this pixel got in all the vote maps
-		// and compute their median
+	// take all the values each pixel got in all the vote maps
+	// and compute their quantile
 
-		Fv.clear();
-
-		for (int p=0; p < Z; p++)
-		{
-			double z = cvGetReal2D(vote_maps[p],i,j);
-			Fv.push_back(z);
-		}
-
-		std::sort(Fv.begin(),Fv.end());
-		
-		double Q = Fv[Q_index];
-		cvSetReal2D(V,i,j,Q);
-	}
+	cv::parallel_for_(cv::Range(0, M), Combine_Rows(cube, Q_index, V));
 
 	if (dbg == 1)
 	{
@@ -945,18 +1307,18 @@ void Fragments_Tracker::Combine_Vote_Maps_Median(vector< CvMat* >& vote_maps, Cv
 
 //
 // find_template - the main routine. Searches for the template in the region defined
-// by minrow,mincol and maxrow,maxcol.
-// Returns the result in result_y,result_x and with it its associated score
+// by minrow,mincol and maxrow,maxcol, at the scale of every search.
+// Returns the result in result_y,result_x and with it its associated score and the
+// scale it was found at. Ties go to the current scale
 //
 
 void Fragments_Tracker::find_template(vector< vector<double>* >& template_histograms,
-							 vector< Patch* >& image_patches,
+							 vector< Scale_Search >& scale_searches,
 							 int img_height, int img_width,
 							 int minrow, int mincol,
 							 int maxrow, int maxcol,
 							 int& result_y, int& result_x, double& score,
-							 vector<int>& x_coords,
-							 vector<int>& y_coords)
+							 double& result_scale)
 {
 	if (minrow<0) {minrow = 0;}
 	if (mincol<0) {mincol = 0;}
@@ -964,57 +1326,85 @@ void Fragments_Tracker::find_template(vector< vector<double>* >& template_histog
 	if (maxcol>=img_width) {maxcol = img_width-1;}
 
 	// in handle frame we already computed the integral histogram
-	// we have it updated in IIV_I
-	
-	vector<double> p_scores;
+	// we have it updated in IH_I, for the patches of all scales
 
-	CvMat* combined_vote = cvCreateMat(maxrow-minrow+1,maxcol-mincol+1,CV_32F);
+	int S = scale_searches.size();
+	for (int s = 0; s < S; s++)
+	{
+		scale_searches[s].combined_vote.create(maxrow-minrow+1,maxcol-mincol+1,CV_32F);
+	}
 
-	compute_all_patch_votes(template_histograms, image_patches , img_height, img_width,
-		                      minrow, mincol, maxrow, maxcol,
-							  combined_vote,
-							  x_coords,
-							  y_coords,
-							  p_scores);
+	compute_all_patch_votes(template_histograms, scale_searches, img_height, img_width,
+		                      minrow, mincol, maxrow, maxcol);
 
-	CvPoint min_loc;
-	CvPoint max_loc;
-	double minval;
-	double maxval;
+	int best = 0;
+	for (int s = 0; s < S; s++)
+	{
+		Scale_Search& search = scale_searches[s];
+
+		cv::Point min_loc;
+		cv::Point max_loc;
+		double minval;
+		double maxval;
 
-	cvMinMaxLoc(combined_vote,&minval,&maxval,&min_loc,&max_loc,NULL);
-	int cx = min_loc.x;
-	int cy = min_loc.y;
+		cv::minMaxLoc(search.combined_vote,&minval,&maxval,&min_loc,&max_loc);
+		int cx = min_loc.x;
+		int cy = min_loc.y;
 
-	result_y = cy + minrow;
-	result_x = cx + mincol;
-	score = minval;
+		search.result_y = cy + minrow;
+		search.result_x = cx + mincol;
+		search.score = minval;
+
+		if (search.scale == curr_scale)
+		{
+			if (search.score <= scale_searches[best].score)
+				best = s;
+		}
+		else if (search.score < scale_searches[best].score)
+		{
+			best = s;
+		}
+
+		if (dbg==1)
+		{
+			outf << endl << "In find-template: at scale " << search.scale << " we searched in the range [" << minrow << "," << maxrow << "]x[" << mincol << "," << maxcol << "] The combined vote map is: " << endl;
+			//util_object.PrintMat_to_stream(search.combined_vote,outf);
+			outf << endl << endl << "The min location is: " << search.result_y << " " << search.result_x;
+			outf << endl << endl << "The min value in this location is: " << search.score;
+		}
+	}
+
+	result_y = scale_searches[best].result_y;
+	result_x = scale_searches[best].result_x;
+	score = scale_searches[best].score;
+	result_scale = scale_searches[best].scale;
 
 	if (dbg==1)
 	{
-		outf << endl << "In find-template: we searched in the range [" << minrow << "," << maxrow << "]x[" << mincol << "," << maxcol << "] The combined vote map is: " << endl;
-		//util_object.PrintMat_to_stream(combined_vote,outf);
-		outf << endl << endl << "The min location is: " << result_y << " " << result_x;
-		outf << endl << endl << "The min value in this location is: " << score;
 		outf << endl << "Exiting find template ";
 	}
 
-	cvReleaseMat(&combined_vote);
-
 	return;
 }
 
 //
 // Update_Template - updates the template's position and makes sure it stays
-// inside the image
+// inside the image. The target is scale_factor times new_height x new_width,
+// scale_factor is clamped to [min_scale, max_scale]
 //
 
 void Fragments_Tracker::Update_Template(int new_height,int new_width,
 								 int new_cy, int new_cx, double scale_factor,
-								 CvMat* I)
+								 const cv::Mat& I)
 {
 	curr_pos_y = new_cy;
 	curr_pos_x = new_cx;
+	curr_scale = min ( max ( scale_factor , min_scale ) , max_scale );
+
+	new_height = (int)floor ( new_height * curr_scale + 0.5 );
+	new_width = (int)floor ( new_width * curr_scale + 0.5 );
+	if (new_height > I.rows) {new_height = I.rows;}
+	if (new_width > I.cols) {new_width = I.cols;}
 
 	int t_halfw = (int)floor((double)new_width / 2.0 );
 	int t_halfh = (int)floor((double)new_height / 2.0 );
@@ -1031,13 +1421,13 @@ void Fragments_Tracker::Update_Template(int new_height,int new_width,
 
 	if (curr_template_tl_y < 0) {curr_template_tl_y = 0;}
 	if (curr_template_tl_x < 0) {curr_template_tl_x = 0;}
-	if (curr_template_tl_y > I->height-new_height)
+	if (curr_template_tl_y > I.rows-new_height)
 	{
-		curr_template_tl_y = I->height-new_height;
+		curr_template_tl_y = I.rows-new_height;
 	}
-	if (curr_template_tl_x > I->width-new_width)
+	if (curr_template_tl_x > I.cols-new_width)
 	{
-		curr_template_tl_x = I->width-new_width;
+		curr_template_tl_x = I.cols-new_width;
 	}
 	
 	return;
@@ -1045,49 +1435,95 @@ void Fragments_Tracker::Update_Template(int new_height,int new_width,
 }
 
 //
-// Handle_Frame - the outside interface after tracker is initialized. Call it with the
-// current frame and get the output in the window outwin, and in the log file
+// Track_Frame - finds the target in the frame I and moves the template there.
+// With params->scale_search the target is searched at every scale factor times
+// its current size, otherwise at its current size. Scales outside
+// [min_scale, max_scale] are not searched
 //
 
-void Fragments_Tracker::Handle_Frame(CvMat* I, char* outwin)
+void Fragments_Tracker::Track_Frame(const cv::Mat& I, double& score)
 {
-
 	handled_frame_number = handled_frame_number + 1;
+
+	//
+	// the patches of every searched scale
+	//
+
+	int S = 0;
+	int F = params->scale_search ? scale_factors.size() : 1;
+	searches.resize(F);
+	for (int f = 0; f < F; f++)
+	{
+		double scale = params->scale_search ? curr_scale * scale_factors[f] : curr_scale;
+		if (scale < min_scale || scale > max_scale)
+		{
+			continue;
+		}
+
+		searches[S].scale = scale;
+		scale_patches ( patches , scale , searches[S].patches );
+		S++;
+	}
+	searches.resize(S);
 	
 	//
-	// build this image's IH. From now on, we only work with
-	// this data structure and not with the image itself
+	// build the IH of the search region and the margin the patches of all scales need.
+	// From now on, we only work with this data structure and not with the image itself
 	//
 	
 	int img_height;
 	int img_width;
-	
-	compute_IH (I, IIV_I );
-	img_height = I->height;
-	img_width = I->width;
+	int margin_y = 0, margin_x = 0;
+
+	for (int s = 0; s < S; s++)
+	{
+		int scale_margin_y, scale_margin_x;
+		patch_margins ( searches[s].patches , scale_margin_y , scale_margin_x );
+		margin_y = max ( margin_y , scale_margin_y );
+		margin_x = max ( margin_x , scale_margin_x );
+	}
+
+	compute_IH ( I , curr_pos_y - (params->search_margin) - margin_y ,
+		         curr_pos_x - (params->search_margin) - margin_x ,
+		         curr_pos_y + (params->search_margin) + margin_y ,
+		         curr_pos_x + (params->search_margin) + margin_x , IH_I );
+	img_height = I.rows;
+	img_width = I.cols;
 	
 	//
 	// find the current template in the current image
 	//
 
-	vector<int> x_coords;
-	vector<int> y_coords;
-
 	int new_yM, new_xM;
-	double score_M;
+	double scale_M;
 
 	find_template(template_patches_histograms,
-				  patches,
+				  searches,
 		          img_height, img_width,
 			      curr_pos_y - (params->search_margin),
 				  curr_pos_x - (params->search_margin),
 				  curr_pos_y + (params->search_margin),
 				  curr_pos_x + (params->search_margin),
-				  new_yM, new_xM, score_M,
-				  x_coords, y_coords);
+				  new_yM, new_xM, score,
+				  scale_M);
+
+
+	Update_Template(curr_template.rows,curr_template.cols,new_yM,new_xM,scale_M,I);
+
+	return;
+}
+
+//
+// Handle_Frame - the outside interface after tracker is initialized. Call it with the
+// current frame and get the output in the window outwin, and in the log file
+//
+
+void Fragments_Tracker::Handle_Frame(const cv::Mat& I, const char* outwin)
+{
 
+	double score_M;
 
-	Update_Template(curr_template->height,curr_template->width,new_yM,new_xM,1,I);
+	Track_Frame(I, score_M);
 
 	//
 	// finished. now output the results
@@ -1112,58 +1548,23 @@ void Fragments_Tracker::Handle_Frame(CvMat* I, char* outwin)
 	// in black and white:
 	//
 
-	CvMat* out_mat = cvCreateMat(I->height,I->width,CV_8UC3);
-	cvCvtPlaneToPix(I,I,I,NULL,out_mat);   // get a gray scale but color image
+	cv::cvtColor(I,out_mat,cv::COLOR_GRAY2BGR);   // get a gray scale but color image
 
 	Draw_Rectangle(curr_template_tl_y, curr_template_tl_x,
 		           curr_template_height, curr_template_width, out_mat);
 
-	cvShowImage(outwin,out_mat);
-	cvReleaseMat(&out_mat);
+	cv::imshow(outwin,out_mat);
 
 	return;
 
 }
 
-void Fragments_Tracker::Handle_Frame_challenge(CvMat* I, char* outwin, VOT * vot_io)
+void Fragments_Tracker::Handle_Frame_challenge(const cv::Mat& I, const char* outwin, VOT * vot_io)
 {
 
-	handled_frame_number = handled_frame_number + 1;
-	
-	//
-	// build this image's IH. From now on, we only work with
-	// this data structure and not with the image itself
-	//
-	
-	int img_height;
-	int img_width;
-	
-	compute_IH (I, IIV_I );
-	img_height = I->height;
-	img_width = I->width;
-	
-	//
-	// find the current template in the current image
-	//
-
-	vector<int> x_coords;
-	vector<int> y_coords;
-
-	int new_yM, new_xM;
 	double score_M;
 
-	find_template(template_patches_histograms,
-				  patches,
-		          img_height, img_width,
-			      curr_pos_y - (params->search_margin),
-				  curr_pos_x - (params->search_margin),
-				  curr_pos_y + (params->search_margin),
-				  curr_pos_x + (params->search_margin),
-				  new_yM, new_xM, score_M,
-				  x_coords, y_coords);
-
-
-	Update_Template(curr_template->height,curr_template->width,new_yM,new_xM,1,I);
+	Track_Frame(I, score_M);
 
 	//
 	// finished. now output the results
@@ -14,9 +14,9 @@ Date:	November 18'th, 2007
 
 #pragma once
 
-#include <cxcore.h>
-#include <cv.h>
-#include <highgui.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
 
 // C++ stuff
 
@@ -48,6 +48,102 @@ struct Patch
 	int h;    //patch height is 2*h+1
 };
 
+//
+// Integral_Histogram - integral histogram of a rectangular region of an image.
+// The B bins of a position are stored next to each other. Row and column 0 are
+// zero, so position (r,c) holds the histogram of rows top..top+r-1 and
+// columns left..left+c-1 of the image
+//
+
+struct Integral_Histogram
+{
+	int B;
+	int top;      // image coordinates of the region
+	int left;
+	int height;   // region size
+	int width;
+	int image_height;
+	int image_width;
+	vector<int> data;   // (height+1) x (width+1) x B
+	vector<uchar> bins; // bin of every pixel of the region, height x width
+};
+
+//
+// Vote_Region - the part of a vote map a patch actually voted for
+//
+
+struct Vote_Region
+{
+	int minrow;
+	int mincol;
+	int maxrow;
+	int maxcol;
+};
+
+//
+// Vote_Scratch - working memory of one voting thread
+//
+
+struct Vote_Scratch
+{
+	vector<int> counts;
+	vector<double> terms;
+	vector<double> hist;   // patch histogram of the reference votes
+};
+
+//
+// Vote_Stats - timing of the voting, accumulated over all frames
+//
+
+struct Vote_Stats
+{
+	int frames;
+	double vote_time;           // seconds, with the configured voting
+	double per_position_time;   // seconds, of the float votes at every position (incremental_votes == 2)
+	double reference_time;      // seconds, of the double precision reference votes (incremental_votes == 2)
+	double max_difference;      // largest relative difference of the incremental votes to the reference
+	double max_difference_per_position;   // the same for the float votes at every position
+	double tolerance;           // largest relative difference that passes
+	double combine_time;        // seconds, combining the vote maps
+};
+
+//
+// Vote_Cube - the vote maps of all Z patches in one block of memory,
+// map p is at p*height*width. maps holds a header for each of them.
+// The maps cover the search region only
+//
+
+struct Vote_Cube
+{
+	int Z;
+	int height;
+	int width;
+	vector<float> data;
+	vector<cv::Mat> maps;
+};
+
+//
+// Scale_Search - the search for the target at one scale. The patches are the
+// template patches scaled by scale, and every search has its own vote maps so
+// that the patches of all scales can vote concurrently
+//
+
+struct Scale_Search
+{
+	double scale;                  // relative to the initial template
+	vector < Patch > patches;
+	Vote_Cube vote_cube;
+	Vote_Cube check_cube;          // reference votes when comparing
+	vector < Vote_Region > vote_regions;
+	vector < int > x_coords;       // position each patch votes for
+	vector < int > y_coords;
+	vector < double > patch_scores;
+	cv::Mat combined_vote;         // over the search region, reused across frames
+	int result_y;                  // best position at this scale and its score
+	int result_x;
+	double score;
+};
+
 //
 // Parameters for initializing the tracker
 //
@@ -73,18 +169,23 @@ struct Parameters
 
 	// metric used for histogram comparison.
 	// 1 means chi-square, 2 means EMD, 3 means Kolmogorov-Smirnov variation
-	// use 3 (equivalent to 2 and as fast as 1)
+	// 2 and 3 are equivalent up to the weighting of the bins, and as fast as 1
 	//
 
 	int metric_used;
 
-};
+	// how the votes are computed:
+	// 0 recomputes the patch histogram at every position, 1 slides the patches
+	// and updates their scores incrementally, 2 does both and compares them
 
-//
-// for EMD we need to have the following global function:
-//
+	int incremental_votes;
 
-float my_dist(feature_t* F1, feature_t* F2);
+	// 1 searches for the target also at 0.95 and 1.05 times its current
+	// size, 0 keeps the size of the initial template
+
+	int scale_search;
+
+};
 
 //
 // The tracker object:
@@ -118,14 +219,21 @@ private:
 	int handled_frame_number;
 	Parameters* params;
 
-	vector < CvMat* > IIV_I;
-	vector < CvMat* > IIV_T;
+	Integral_Histogram IH_I;   // of the search region in the current frame
+	Integral_Histogram IH_T;   // of the template
+	int pixel_bin[256];        // bin of every gray value
 	
 	vector < Patch* > patches;
 	vector < vector<double>* > template_patches_histograms;
-	vector < CvMat* > patch_vote_maps;
+	vector < Scale_Search > searches;   // one per searched scale, reused across frames
+	vector < double > scale_factors;    // searched scales relative to the current one
+	double curr_scale;                  // of the target relative to the initial template
+	double min_scale;                   // range of curr_scale, see the constructor
+	double max_scale;
+	vector < float > template_bins;   // template patch histograms for voting, B per patch
+	cv::Mat out_mat;                  // the frame shown by Handle_Frame, reused across frames
 	
-	CvMat* curr_template;
+	cv::Mat curr_template;
 	int curr_pos_y;
 	int curr_pos_x;
 	int curr_template_tl_y;
@@ -133,10 +241,8 @@ private:
 	int curr_template_height;
 	int curr_template_width;
 
-	feature_t* F1;
-	feature_t* F2;
-	float* w1;
-	float* w2;
+	vector < double > bin_centers;   // gray value at the center of every bin, for EMD
+	vector < float > bin_gaps;       // between the centers of every bin and the next one
 
 	//
 	// ****************************************************************
@@ -150,28 +256,32 @@ private:
 
 public:
 
-	Fragments_Tracker(CvMat* I, Parameters& in_params, ofstream& log_file);
+	Vote_Stats vote_stats;
 
-	void Handle_Frame(CvMat* I, char* outwin);
-    void Handle_Frame_challenge(CvMat* I, char* outwin, VOT * vot_io);
+	Fragments_Tracker(cv::Mat& I, Parameters& in_params, ofstream& log_file);
+
+	void Handle_Frame(const cv::Mat& I, const char* outwin);
+    void Handle_Frame_challenge(const cv::Mat& I, const char* outwin, VOT * vot_io);
 
 	~Fragments_Tracker(void);
 
 private:
 
 	void define_patches(int height, int width, vector < Patch* >& patch_vec);
-	void Build_Template_Patch_Histograms(CvMat* T,
+	void Build_Template_Patch_Histograms(const cv::Mat& T,
 		                                 vector< vector<double>* >& patch_histograms);
 
 
-	void Get_Pixel_Bin(CvMat* I, CvMat* bin_mat);
-	bool compute_IH(CvMat* I, vector< CvMat* >& vec_II);
+	void init_pixel_bins();
+	void patch_margins(vector< Patch >& patch_vec, int& margin_y, int& margin_x);
+	void scale_patches(vector< Patch* >& patch_vec, double scale, vector< Patch >& scaled);
+	bool compute_IH(const cv::Mat& I, int minrow, int mincol, int maxrow, int maxcol,
+		            Integral_Histogram& ih);
 	bool compute_histogram(int tl_y, int tl_x, int br_y, int br_x,
-		                   vector< CvMat* >& iiv, vector< double >& hist);
+		                   Integral_Histogram& ih, vector< double >& hist);
 
 
 	void Init_EMD_Stuff();
-	void init_bin_distance_matrix();
 
 
 	double compare_histograms(vector < double >& hist1, vector < double >& hist2);
@@ -179,37 +289,45 @@ private:
 	double compare_histograms_ks( vector < double >& h1 , vector < double >& h2 );
 
 
-	void compute_single_patch_votes ( Patch* p , vector < double >& hist ,
+	void compute_single_patch_votes ( Patch* p , const float* template_bins,
+										   vector<double>* reference_hist,
 										   int minrow, int mincol,
 										   int maxrow, int maxcol,
-										   CvMat* votes, int& min_r, int& min_c,
+										   cv::Mat& votes, bool incremental, Vote_Scratch& scratch,
+										   int& min_r, int& min_c,
 										   int& max_r, int& max_c);
+	void slide_patch_votes ( Patch* p , const float* template_bins ,
+							 int miny , int maxy , int minx , int maxx ,
+							 int minrow , int mincol , cv::Mat& votes ,
+							 Vote_Scratch& scratch );
 	void compute_all_patch_votes(vector< vector<double>* >& patch_histograms,
-								   vector< Patch* >& tested_patches,
+								   vector< Scale_Search >& scale_searches,
 								   int img_height, int img_width,
    								   int minrow, int mincol,
-								   int maxrow, int maxcol , CvMat* combined_vote,
-								   vector<int>& x_coords,
-								   vector<int>& y_coords,
-								   vector<double>& patch_scores) ;
-	void Combine_Vote_Maps_Median(vector< CvMat* >& vote_maps, CvMat* V);
+								   int maxrow, int maxcol) ;
+	void shape_vote_cube(Vote_Cube& cube, int Z, int height, int width);
+	void compare_vote_cubes(Vote_Cube& cube, Vote_Cube& reference, double& max_difference);
+	void Combine_Vote_Maps_Median(Vote_Cube& cube, cv::Mat& V);
 
 
 
 	void find_template(vector< vector<double>* >& template_histograms,
-					   vector< Patch* >& image_patches,
+					   vector< Scale_Search >& scale_searches,
 					   int img_height, int img_width,
 					   int minrow, int mincol,
 					   int maxrow, int maxcol,
 					   int& result_y, int& result_x, double& score,
-					   vector<int>& x_coords, vector<int>& y_coords);
+					   double& result_scale);
+	void Track_Frame(const cv::Mat& I, double& score);
 	void Update_Template(int new_height,int new_width,
 						   int new_cy, int new_cx, double scale_factor,
-						   CvMat* I);
+						   const cv::Mat& I);
+
 
 
+	void Draw_Rectangle(int tl_y, int tl_x, int height, int width, cv::Mat& I);
 
-	void Draw_Rectangle(int tl_y, int tl_x, int height, int width, CvMat* I);
+	friend class Patch_Votes;
 
 };
 
@@ -30,54 +30,6 @@
 */
 
 
-#define MAX_SIG_SIZE1  (MAX_SIG_SIZE+1)  /* FOR THE POSIBLE DUMMY FEATURE */
-
-/* NEW TYPES DEFINITION */
-
-/* node1_t IS USED FOR SINGLE-LINKED LISTS */
-typedef struct node1_t {
-  int i;
-  double val;
-  struct node1_t *Next;
-} node1_t;
-
-/* node1_t IS USED FOR DOUBLE-LINKED LISTS */
-typedef struct node2_t {
-  int i, j;
-  double val;
-  struct node2_t *NextC;               /* NEXT COLUMN */
-  struct node2_t *NextR;               /* NEXT ROW */
-} node2_t;
-
-
-
-/* GLOBAL VARIABLE DECLARATION */
-static int _n1, _n2;                          /* SIGNATURES SIZES */
-static float _C[MAX_SIG_SIZE1][MAX_SIG_SIZE1];/* THE COST MATRIX */
-static node2_t _X[MAX_SIG_SIZE1*2];            /* THE BASIC VARIABLES VECTOR */
-/* VARIABLES TO HANDLE _X EFFICIENTLY */
-static node2_t *_EndX, *_EnterX;
-static char _IsX[MAX_SIG_SIZE1][MAX_SIG_SIZE1];
-static node2_t *_RowsX[MAX_SIG_SIZE1], *_ColsX[MAX_SIG_SIZE1];
-static double _maxW;
-static float _maxC;
-
-/* DECLARATION OF FUNCTIONS */
-static float init(signature_t *Signature1, signature_t *Signature2,
-		  float (*Dist)(feature_t *, feature_t *));
-static void findBasicVariables(node1_t *U, node1_t *V);
-static int isOptimal(node1_t *U, node1_t *V);
-static int findLoop(node2_t **Loop);
-static void newSol();
-static void russel(double *S, double *D);
-static void addBasicVariable(int minI, int minJ, double *S, double *D, 
-			     node1_t *PrevUMinI, node1_t *PrevVMinJ,
-			     node1_t *UHead);
-#if DEBUG_LEVEL > 0
-static void printSolution();
-#endif
-
-
 /******************************************************************************
 float emd(signature_t *Signature1, signature_t *Signature2,
 	  float (*Dist)(feature_t *, feature_t *), flow_t *Flow, int *FlowSize)
@@ -101,13 +53,23 @@ where
 float emd(signature_t *Signature1, signature_t *Signature2,
 	  float (*Dist)(feature_t *, feature_t *),
 	  flow_t *Flow, int *FlowSize)
+{
+  static EMD_Solver *Solver = new EMD_Solver;
+
+  return Solver->emd(Signature1, Signature2, Dist, Flow, FlowSize);
+}
+
+
+float EMD_Solver::emd(signature_t *Signature1, signature_t *Signature2,
+		      float (*Dist)(feature_t *, feature_t *),
+		      flow_t *Flow, int *FlowSize)
 {
   int itr;
   double totalCost;
   float w;
   node2_t *XP;
   flow_t *FlowP;
-  node1_t U[MAX_SIG_SIZE1], V[MAX_SIG_SIZE1];
+  node1_t *U = _U, *V = _V;
 
   w = init(Signature1, Signature2, Dist);
 
@@ -182,13 +144,13 @@ float emd(signature_t *Signature1, signature_t *Signature2,
 /**********************
    init
 **********************/
-static float init(signature_t *Signature1, signature_t *Signature2, 
-		  float (*Dist)(feature_t *, feature_t *))
+float EMD_Solver::init(signature_t *Signature1, signature_t *Signature2, 
+		       float (*Dist)(feature_t *, feature_t *))
 {
   int i, j;
   double sSum, dSum, diff;
   feature_t *P1, *P2;
-  double S[MAX_SIG_SIZE1], D[MAX_SIG_SIZE1];
+  double *S = _S, *D = _D;
  
   _n1 = Signature1->n;
   _n2 = Signature2->n;
@@ -267,7 +229,7 @@ static float init(signature_t *Signature1, signature_t *Signature2,
 /**********************
     findBasicVariables
  **********************/
-static void findBasicVariables(node1_t *U, node1_t *V)
+void EMD_Solver::findBasicVariables(node1_t *U, node1_t *V)
 {
   int i, j, found;
   int UfoundNum, VfoundNum;
@@ -405,7 +367,7 @@ static void findBasicVariables(node1_t *U, node1_t *V)
 /**********************
     isOptimal
  **********************/
-static int isOptimal(node1_t *U, node1_t *V)
+int EMD_Solver::isOptimal(node1_t *U, node1_t *V)
 {    
   double delta, deltaMin;
   int i, j, minI, minJ;
@@ -450,12 +412,12 @@ static int isOptimal(node1_t *U, node1_t *V)
 /**********************
     newSol
 **********************/
-static void newSol()
+void EMD_Solver::newSol()
 {
     int i, j, k;
     double xMin;
     int steps;
-    node2_t *Loop[2*MAX_SIG_SIZE1], *CurX, *LeaveX;
+    node2_t **Loop = _Loop, *CurX, *LeaveX;
  
 #if DEBUG_LEVEL > 3
     printf("EnterX = (%d,%d)\n", _EnterX->i, _EnterX->j);
@@ -528,11 +490,11 @@ static void newSol()
 /**********************
     findLoop
 **********************/
-static int findLoop(node2_t **Loop)
+int EMD_Solver::findLoop(node2_t **Loop)
 {
   int i, steps;
   node2_t **CurX, *NewX;
-  char IsUsed[2*MAX_SIG_SIZE1]; 
+  char *IsUsed = _IsUsed;
  
   for (i=0; i < _n1+_n2; i++)
     IsUsed[i] = 0;
@@ -622,12 +584,12 @@ static int findLoop(node2_t **Loop)
 /**********************
     russel
 **********************/
-static void russel(double *S, double *D)
+void EMD_Solver::russel(double *S, double *D)
 {
   int i, j, found, minI, minJ;
   double deltaMin, oldVal, diff;
-  double Delta[MAX_SIG_SIZE1][MAX_SIG_SIZE1];
-  node1_t Ur[MAX_SIG_SIZE1], Vr[MAX_SIG_SIZE1];
+  double (*Delta)[MAX_SIG_SIZE1] = _Delta;
+  node1_t *Ur = _Ur, *Vr = _Vr;
   node1_t uHead, *CurU, *PrevU;
   node1_t vHead, *CurV, *PrevV;
   node1_t *PrevUMinI, *PrevVMinJ, *Remember;
@@ -783,9 +745,9 @@ static void russel(double *S, double *D)
 /**********************
     addBasicVariable
 **********************/
-static void addBasicVariable(int minI, int minJ, double *S, double *D, 
-			     node1_t *PrevUMinI, node1_t *PrevVMinJ,
-			     node1_t *UHead)
+void EMD_Solver::addBasicVariable(int minI, int minJ, double *S, double *D, 
+				  node1_t *PrevUMinI, node1_t *PrevVMinJ,
+				  node1_t *UHead)
 {
   double T;
   
@@ -834,7 +796,7 @@ static void addBasicVariable(int minI, int minJ, double *S, double *D,
 /**********************
     printSolution
 **********************/
-static void printSolution()
+void EMD_Solver::printSolution()
 {
   node2_t *P;
   double totalCost;
@@ -857,3 +819,31 @@ static void printSolution()
 }
 
 
+
+
+/******************************************************************************
+double emd_1d(int n, const double *Weights1, const double *Weights2,
+	      const double *Positions)
+
+   Moving the weights across the gap between Positions[b] and Positions[b+1]
+   costs the difference of the cumulative weights of bins 0..b.
+   As emd(), the cost is normalized by the total weight.
+******************************************************************************/
+
+double emd_1d(int n, const double *Weights1, const double *Weights2,
+	      const double *Positions)
+{
+  int b;
+  double cdf1, cdf2, totalCost;
+
+  cdf1 = cdf2 = totalCost = 0;
+  for (b=0; b < n-1; b++)
+    {
+      cdf1 += Weights1[b];
+      cdf2 += Weights2[b];
+      totalCost += fabs(cdf1 - cdf2) * (Positions[b+1] - Positions[b]);
+    }
+  cdf1 += Weights1[n-1];
+
+  return cdf1 > 0 ? totalCost / cdf1 : 0;
+}
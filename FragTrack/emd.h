@@ -49,8 +49,81 @@ typedef struct
 
 
 
+#define MAX_SIG_SIZE1  (MAX_SIG_SIZE+1)  /* FOR THE POSIBLE DUMMY FEATURE */
+
+/* node1_t IS USED FOR SINGLE-LINKED LISTS */
+typedef struct node1_t {
+  int i;
+  double val;
+  struct node1_t *Next;
+} node1_t;
+
+/* node1_t IS USED FOR DOUBLE-LINKED LISTS */
+typedef struct node2_t {
+  int i, j;
+  double val;
+  struct node2_t *NextC;               /* NEXT COLUMN */
+  struct node2_t *NextR;               /* NEXT ROW */
+} node2_t;
+
+
+/*
+   EMD_Solver holds the working memory of the transportation simplex, so
+   that every solver can be used from its own thread. The workspaces take
+   about 1MB, allocate solvers with new rather than on the stack.
+*/
+class EMD_Solver
+{
+public:
+  float emd(signature_t *Signature1, signature_t *Signature2,
+	    float (*func)(feature_t *, feature_t *),
+	    flow_t *Flow, int *FlowSize);
+
+private:
+  float init(signature_t *Signature1, signature_t *Signature2,
+	     float (*Dist)(feature_t *, feature_t *));
+  void findBasicVariables(node1_t *U, node1_t *V);
+  int isOptimal(node1_t *U, node1_t *V);
+  int findLoop(node2_t **Loop);
+  void newSol();
+  void russel(double *S, double *D);
+  void addBasicVariable(int minI, int minJ, double *S, double *D, 
+			node1_t *PrevUMinI, node1_t *PrevVMinJ,
+			node1_t *UHead);
+  void printSolution();
+
+  int _n1, _n2;                          /* SIGNATURES SIZES */
+  float _C[MAX_SIG_SIZE1][MAX_SIG_SIZE1];/* THE COST MATRIX */
+  node2_t _X[MAX_SIG_SIZE1*2];            /* THE BASIC VARIABLES VECTOR */
+  /* VARIABLES TO HANDLE _X EFFICIENTLY */
+  node2_t *_EndX, *_EnterX;
+  char _IsX[MAX_SIG_SIZE1][MAX_SIG_SIZE1];
+  node2_t *_RowsX[MAX_SIG_SIZE1], *_ColsX[MAX_SIG_SIZE1];
+  double _maxW;
+  float _maxC;
+
+  /* WORKSPACES OF THE ROUTINES ABOVE */
+  node1_t _U[MAX_SIG_SIZE1], _V[MAX_SIG_SIZE1];
+  double _S[MAX_SIG_SIZE1], _D[MAX_SIG_SIZE1];
+  node2_t *_Loop[2*MAX_SIG_SIZE1];
+  char _IsUsed[2*MAX_SIG_SIZE1];
+  double _Delta[MAX_SIG_SIZE1][MAX_SIG_SIZE1];
+  node1_t _Ur[MAX_SIG_SIZE1], _Vr[MAX_SIG_SIZE1];
+};
+
+
+/* emd() SHARES ONE SOLVER BETWEEN ALL CALLS, IT IS NOT REENTRANT */
 float emd(signature_t *Signature1, signature_t *Signature2,
 	  float (*func)(feature_t *, feature_t *),
 	  flow_t *Flow, int *FlowSize);
 
+/*
+   emd_1d() is the EMD of two histograms over the same one-dimensional bins
+   with the ground distance |Positions[i] - Positions[j]|, in O(n). Positions
+   must increase and both histograms must have the same total weight. In one
+   dimension the EMD is the L1 distance between the cumulative histograms.
+*/
+double emd_1d(int n, const double *Weights1, const double *Weights2,
+	      const double *Positions);
+
 #endif
@@ -70,7 +70,7 @@ public:
 
 		std::string line;
 		std::getline (p_images_stream, line);
-		img = cv::imread(line, CV_LOAD_IMAGE_COLOR);
+		img = cv::imread(line, cv::IMREAD_COLOR);
 
 		printf("Processing");
 		printf(line.c_str());